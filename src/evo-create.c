@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -7,19 +8,43 @@
 #include <sys/types.h>
 #include <stdint.h>
 #include <getopt.h>
+#include <errno.h>
+#include <limits.h>
+#include <ftw.h>
 #include "evo_format.h"
 #include "evo_metadata.h"
+#include "evo_checksum.h"
+#include "evo_slice.h"
+#include "evo_sha256.h"
+#include "evo_tree.h"
+#include "evo_output.h"
+#include "evo_chunks.h"
 
 void parse_supported_architectures(evo_metadata *metadata, const char *architectures);
 void parse_required_permissions(evo_metadata *metadata, const char *permissions);
-
-#define BUFFER_SIZE 4096
+int collect_extents(int fd, off_t size, struct evo_extent **extents, uint32_t *num_extents);
+int write_checksummed(int fd, const void *data, size_t length, struct evo_checksum *ctx);
+int add_slice(struct evo_slice *slices, char **slice_paths, uint32_t *num_slices,
+              const char *architecture, size_t architecture_length, char *path);
+int parse_slice(struct evo_slice *slices, char **slice_paths, uint32_t *num_slices, char *spec);
+int create_sliced_package(const char *output_file, evo_metadata *metadata,
+                          struct evo_slice *slices, char **slice_paths, uint32_t num_slices);
+int create_tree_package(const char *input_dir, const char *output_file, evo_metadata *metadata);
+int record_chunks(struct evo_checksum *ctx, uint64_t package_size);
+void save_chunks(const char *output_file, uint64_t package_size, const struct evo_checksum *ctx);
+
+#define BUFFER_SIZE (1024 * 1024)
 
 #define MAX_ARCHITECTURES 10
 #define MAX_PERMISSIONS 50
 
+// With --chunk-index the crc of every checksum chunk is kept while the
+// package is written and saved next to it as "<output>.evo-chunks"
+static int chunk_index;
+static uint32_t *chunk_crcs;
+
 void print_usage(const char *program_name) {
-    fprintf(stderr, "Usage: %s --input <input_file> --output <output_file.evo> [OPTIONS]\n", program_name);
+    fprintf(stderr, "Usage: %s --input <input_file|input_dir> --output <output_file.evo> [OPTIONS]\n", program_name);
     fprintf(stderr, "Options:\n");
     fprintf(stderr, "  --supported-architectures <arch1,arch2,...>  Comma-separated list of supported mobile architectures\n");
     fprintf(stderr, "  --min-screen-width <width>                   Minimum screen width\n");
@@ -27,6 +52,9 @@ void print_usage(const char *program_name) {
     fprintf(stderr, "  --required-permissions <perm1,perm2,...>     Comma-separated list of required permissions\n");
     fprintf(stderr, "  --target-sdk-version <version>               Target SDK version for mobile platforms\n");
     fprintf(stderr, "  --min-os-version <version>                   Minimum supported mobile OS version\n");
+    fprintf(stderr, "  --slice <arch>=<file>                        Add a per-architecture payload (repeatable);\n");
+    fprintf(stderr, "                                               --input then becomes the shared payload\n");
+    fprintf(stderr, "  --chunk-index                                Also write <output_file>.evo-chunks for evo-repair\n");
 }
 
 uint32_t crc32(const void *data, size_t length) {
@@ -63,14 +91,31 @@ void initialize_default_metadata(evo_metadata *metadata) {
 int main(int argc, char *argv[]) {
     char *input_file = NULL;
     char *output_file = NULL;
-    char buffer[BUFFER_SIZE];
-    ssize_t bytes_read, bytes_written;
+    static char buffer[BUFFER_SIZE];
+    ssize_t bytes_read;
     evo_metadata metadata;
     initialize_default_metadata(&metadata);
+    struct evo_slice slices[EVO_MAX_SLICES];
+    char *slice_paths[EVO_MAX_SLICES];
+    uint32_t num_slices = 0;
+
+    static const struct option long_options[] = {
+        {"input", required_argument, NULL, 'i'},
+        {"output", required_argument, NULL, 'o'},
+        {"supported-architectures", required_argument, NULL, 'a'},
+        {"min-screen-width", required_argument, NULL, 'w'},
+        {"min-screen-height", required_argument, NULL, 'h'},
+        {"required-permissions", required_argument, NULL, 'p'},
+        {"target-sdk-version", required_argument, NULL, 's'},
+        {"min-os-version", required_argument, NULL, 'v'},
+        {"slice", required_argument, NULL, 'S'},
+        {"chunk-index", no_argument, NULL, 'c'},
+        {NULL, 0, NULL, 0}
+    };
 
     // Parse command-line arguments
     int opt;
-    while ((opt = getopt(argc, argv, "i:o:a:w:h:p:s:v:")) != -1) {
+    while ((opt = getopt_long(argc, argv, "i:o:a:w:h:p:s:v:S:c", long_options, NULL)) != -1) {
         switch (opt) {
             case 'i':
                 input_file = optarg;
@@ -96,17 +141,32 @@ int main(int argc, char *argv[]) {
             case 'v':
                 strncpy(metadata.min_os_version, optarg, EVO_MAX_VERSION_LENGTH - 1);
                 break;
+            case 'S':
+                if (parse_slice(slices, slice_paths, &num_slices, optarg) == -1)
+                    return 1;
+                break;
+            case 'c':
+                chunk_index = 1;
+                break;
             default:
                 print_usage(argv[0]);
                 return 1;
         }
     }
 
-    if (input_file == NULL || output_file == NULL) {
+    if (output_file == NULL || (input_file == NULL && num_slices == 0)) {
         print_usage(argv[0]);
         return 1;
     }
 
+    // With per-architecture slices, --input holds the shared resources
+    if (num_slices > 0) {
+        if (input_file != NULL &&
+            add_slice(slices, slice_paths, &num_slices, EVO_SLICE_SHARED, strlen(EVO_SLICE_SHARED), input_file) == -1)
+            return 1;
+        return create_sliced_package(output_file, &metadata, slices, slice_paths, num_slices);
+    }
+
     // Open input file
     int input_fd = open(input_file, O_RDONLY);
     if (input_fd == -1) {
@@ -124,167 +184,605 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
+    // Directories are packaged as a file tree with per-file digests
+    if (S_ISDIR(input_stat.st_mode)) {
+        close(input_fd);
+        return create_tree_package(input_file, output_file, &metadata);
+    }
+
+    // Map out the allocated ranges of the input
+    struct evo_extent *extents = NULL;
+    uint32_t num_extents = 0;
+    if (collect_extents(input_fd, input_stat.st_size, &extents, &num_extents) == -1) {
+        perror("Error mapping input file extents");
+        close(input_fd);
+        return 1;
+    }
+    int sparse = input_stat.st_size > 0 &&
+                 !(num_extents == 1 && extents[0].offset == 0 &&
+                   extents[0].length == (uint64_t)input_stat.st_size);
+
+    uint64_t payload_size = 0;
+    for (uint32_t i = 0; i < num_extents; i++) {
+        payload_size += extents[i].length;
+    }
+
     // Prepare header
     struct evo_header header;
     memcpy(header.magic, EVO_MAGIC, sizeof(header.magic));
-    header.version = 1;
-    header.data_size = input_stat.st_size;
-
-    // Initialize metadata
-    evo_metadata metadata;
-    initialize_default_metadata(&metadata);
+    header.version = sparse ? EVO_VERSION_SPARSE : EVO_VERSION;
     header.metadata_size = sizeof(evo_metadata);
+    header.data_size = payload_size;
+    if (sparse) {
+        header.data_size += (uint64_t)num_extents * sizeof(struct evo_extent) + sizeof(struct evo_extent_table);
+        printf("Sparse input: %u extents, %lu of %ld bytes allocated\n", num_extents, payload_size, input_stat.st_size);
+    }
 
-
+    struct evo_extent_table table;
+    table.image_size = input_stat.st_size;
+    table.num_extents = num_extents;
+    table.reserved = 0;
 
     // Open output file
-    int output_fd = open(output_file, O_RDWR | O_CREAT | O_TRUNC, 0644);
-    if (output_fd == -1) {
+    struct evo_output output;
+    if (evo_output_open(&output, output_file) == -1) {
         perror("Error opening output file");
+        free(extents);
         close(input_fd);
         return 1;
     }
+    int output_fd = output.fd;
     printf("Output file descriptor: %d\n", output_fd);
 
+    // The package checksum is accumulated as each section is written, so
+    // the output never has to be read back.
+    static struct evo_checksum ctx;
+    evo_checksum_init(&ctx);
+    uint64_t package_size = sizeof(header) + header.metadata_size + header.data_size + sizeof(struct evo_footer);
+
     // Write header
-    if (write(output_fd, &header, sizeof(header)) != sizeof(header)) {
+    if (record_chunks(&ctx, package_size) == -1 ||
+        write_checksummed(output_fd, &header, sizeof(header), &ctx) == -1) {
         perror("Error writing header");
+        free(extents);
         close(input_fd);
-        close(output_fd);
+        evo_output_abort(&output);
         return 1;
     }
 
     // Write metadata
-    if (write(output_fd, &metadata, sizeof(metadata)) != sizeof(metadata)) {
+    if (write_checksummed(output_fd, &metadata, sizeof(metadata), &ctx) == -1) {
         perror("Error writing metadata");
+        free(extents);
         close(input_fd);
-        close(output_fd);
+        evo_output_abort(&output);
         return 1;
     }
 
-    // Copy input file content to output file
-    while ((bytes_read = read(input_fd, buffer, BUFFER_SIZE)) > 0) {
-        bytes_written = write(output_fd, buffer, bytes_read);
-        if (bytes_written != bytes_read) {
-            perror("Error writing data");
+    // Copy the allocated ranges of the input file to the output file
+    for (uint32_t i = 0; i < num_extents; i++) {
+        uint64_t offset = extents[i].offset;
+        uint64_t remaining = extents[i].length;
+        while (remaining > 0) {
+            size_t chunk = remaining < BUFFER_SIZE ? (size_t)remaining : BUFFER_SIZE;
+            bytes_read = pread(input_fd, buffer, chunk, offset);
+            if (bytes_read <= 0) {
+                if (bytes_read == 0)
+                    fprintf(stderr, "Error reading input file: unexpected end of file\n");
+                else
+                    perror("Error reading input file");
+                free(extents);
+                close(input_fd);
+                evo_output_abort(&output);
+                return 1;
+            }
+            if (write_checksummed(output_fd, buffer, bytes_read, &ctx) == -1) {
+                perror("Error writing data");
+                free(extents);
+                close(input_fd);
+                evo_output_abort(&output);
+                return 1;
+            }
+            offset += bytes_read;
+            remaining -= bytes_read;
+        }
+    }
+
+    // Write extent map
+    if (sparse) {
+        if (write_checksummed(output_fd, extents, (size_t)num_extents * sizeof(struct evo_extent), &ctx) == -1 ||
+            write_checksummed(output_fd, &table, sizeof(table), &ctx) == -1) {
+            perror("Error writing extent map");
+            free(extents);
             close(input_fd);
-            close(output_fd);
+            evo_output_abort(&output);
             return 1;
         }
     }
+    free(extents);
+
+    // Prepare and write footer
+    struct evo_footer footer;
+    footer.checksum = evo_checksum_final(&ctx);
+    printf("Final checksum in hexadecimal: 0x%08x\n", footer.checksum);
+    printf("Final checksum in decimal: %u\n", footer.checksum);
 
-    if (bytes_read == -1) {
-        perror("Error reading input file");
+    ssize_t footer_bytes_written = write(output_fd, &footer, sizeof(footer));
+    if (footer_bytes_written != sizeof(footer)) {
+        perror("Error writing footer");
+        printf("Expected to write %zu bytes, but wrote %zd bytes\n", sizeof(footer), footer_bytes_written);
         close(input_fd);
-        close(output_fd);
+        evo_output_abort(&output);
         return 1;
     }
-
-    // Calculate checksum for the entire file content (except footer)
-    uint32_t calculated_checksum = 0xffffffff;
-    printf("Starting checksum calculation...\n");
-    printf("Initial checksum value: 0x%08x\n", calculated_checksum);
-
-    // Get total file size
-    off_t file_size = lseek(output_fd, 0, SEEK_END);
-    if (file_size == -1) {
-        perror("Error getting file size");
+    off_t final_size = lseek(output_fd, 0, SEEK_END);
+    if (final_size == -1) {
+        perror("Error getting final file size");
         close(input_fd);
-        close(output_fd);
+        evo_output_abort(&output);
+        return 1;
+    }
+    printf("Footer written successfully. Final file size: %ld bytes\n", final_size);
+    printf("Footer data: checksum=%u\n", footer.checksum);
+
+    // Close files
+    printf("Closing file descriptors. input_fd: %d, output_fd: %d\n", input_fd, output_fd);
+    if (close(input_fd) == -1) {
+        perror("Error closing input file");
+    }
+    if (evo_output_publish(&output) == -1) {
+        perror("Error publishing output file");
         return 1;
     }
+    save_chunks(output_file, package_size, &ctx);
+
+    printf("Successfully created %s\n", output_file);
+    return 0;
+}
+
+int add_slice(struct evo_slice *slices, char **slice_paths, uint32_t *num_slices,
+              const char *architecture, size_t architecture_length, char *path) {
+    if (architecture_length == 0 || architecture_length >= EVO_MAX_SLICE_NAME_LENGTH ||
+        *path == '\0' || *num_slices >= EVO_MAX_SLICES) {
+        fprintf(stderr, "Invalid slice: %.*s\n", (int)architecture_length, architecture);
+        return -1;
+    }
+    struct evo_slice *slice = &slices[*num_slices];
+    memset(slice, 0, sizeof(*slice));
+    memcpy(slice->architecture, architecture, architecture_length);
+    if (!evo_safe_slice_name(slice->architecture)) {
+        fprintf(stderr, "Invalid slice name: %s\n", slice->architecture);
+        return -1;
+    }
+    if (evo_find_slice(slices, *num_slices, slice->architecture) != NULL) {
+        fprintf(stderr, "Duplicate slice: %s\n", slice->architecture);
+        return -1;
+    }
+    slice_paths[*num_slices] = path;
+    (*num_slices)++;
+    return 0;
+}
+
+int parse_slice(struct evo_slice *slices, char **slice_paths, uint32_t *num_slices, char *spec) {
+    char *separator = strchr(spec, '=');
+    if (separator == NULL) {
+        fprintf(stderr, "Invalid slice: %s (expected <arch>=<file>)\n", spec);
+        return -1;
+    }
+    return add_slice(slices, slice_paths, num_slices, spec, separator - spec, separator + 1);
+}
+
+int create_sliced_package(const char *output_file, evo_metadata *metadata,
+                          struct evo_slice *slices, char **slice_paths, uint32_t num_slices) {
+    static char buffer[BUFFER_SIZE];
+
+    // Size every slice up front so the header is final before any data
+    uint64_t offset = 0;
+    for (uint32_t i = 0; i < num_slices; i++) {
+        struct stat slice_stat;
+        if (stat(slice_paths[i], &slice_stat) == -1) {
+            perror(slice_paths[i]);
+            return 1;
+        }
+        slices[i].offset = offset;
+        slices[i].size = slice_stat.st_size;
+        offset += slices[i].size;
+        printf("Slice %s: %s (%lu bytes)\n", slices[i].architecture, slice_paths[i], slices[i].size);
+
+        // Architectures not listed explicitly are taken from the slices
+        if (strcmp(slices[i].architecture, EVO_SLICE_SHARED) != 0 &&
+            metadata->num_supported_architectures < EVO_MAX_ARCHITECTURES) {
+            int listed = 0;
+            for (uint32_t j = 0; j < metadata->num_supported_architectures; j++) {
+                if (strcmp(metadata->supported_architectures[j], slices[i].architecture) == 0)
+                    listed = 1;
+            }
+            if (!listed) {
+                strncpy(metadata->supported_architectures[metadata->num_supported_architectures],
+                        slices[i].architecture, EVO_MAX_NAME_LENGTH - 1);
+                metadata->num_supported_architectures++;
+            }
+        }
+    }
+
+    struct evo_header header;
+    memcpy(header.magic, EVO_MAGIC, sizeof(header.magic));
+    header.version = EVO_VERSION_SLICED;
+    header.metadata_size = sizeof(evo_metadata);
+    header.data_size = offset + (uint64_t)num_slices * sizeof(struct evo_slice) + sizeof(struct evo_slice_table);
 
-    // Calculate bytes to read (excluding footer)
-    off_t bytes_to_read = file_size - sizeof(struct evo_footer);
-    printf("File size: %ld, Bytes to read: %ld\n", file_size, bytes_to_read);
-    printf("Total file size: %ld\n", file_size);
-    printf("Bytes to read for checksum: %ld\n", bytes_to_read);
-    printf("Initial checksum value: 0x%08x\n", calculated_checksum);
+    struct evo_output output;
+    if (evo_output_open(&output, output_file) == -1) {
+        perror("Error opening output file");
+        return 1;
+    }
+    int output_fd = output.fd;
+
+    static struct evo_checksum ctx;
+    evo_checksum_init(&ctx);
+    uint64_t package_size = sizeof(header) + header.metadata_size + header.data_size + sizeof(struct evo_footer);
+    if (record_chunks(&ctx, package_size) == -1 ||
+        write_checksummed(output_fd, &header, sizeof(header), &ctx) == -1 ||
+        write_checksummed(output_fd, metadata, sizeof(*metadata), &ctx) == -1) {
+        perror("Error writing header");
+        evo_output_abort(&output);
+        return 1;
+    }
 
-    // Seek to the beginning of the output file
-    if (lseek(output_fd, 0, SEEK_SET) == -1) {
-        perror("Error seeking to beginning of file for checksum calculation");
+    // Copy each slice, checksumming it on its own as well as in the package
+    for (uint32_t i = 0; i < num_slices; i++) {
+        int input_fd = open(slice_paths[i], O_RDONLY);
+        if (input_fd == -1) {
+            perror(slice_paths[i]);
+            evo_output_abort(&output);
+            return 1;
+        }
+        static struct evo_checksum slice_ctx;
+        evo_checksum_init(&slice_ctx);
+        uint64_t remaining = slices[i].size;
+        while (remaining > 0) {
+            size_t chunk = remaining < BUFFER_SIZE ? (size_t)remaining : BUFFER_SIZE;
+            ssize_t bytes_read = read(input_fd, buffer, chunk);
+            if (bytes_read <= 0) {
+                fprintf(stderr, "Error reading %s\n", slice_paths[i]);
+                close(input_fd);
+                evo_output_abort(&output);
+                return 1;
+            }
+            if (write_checksummed(output_fd, buffer, bytes_read, &ctx) == -1) {
+                perror("Error writing data");
+                close(input_fd);
+                evo_output_abort(&output);
+                return 1;
+            }
+            evo_checksum_update(&slice_ctx, buffer, bytes_read);
+            remaining -= bytes_read;
+        }
         close(input_fd);
-        close(output_fd);
+        slices[i].checksum = evo_checksum_final(&slice_ctx);
+        printf("Slice %s checksum: 0x%08x\n", slices[i].architecture, slices[i].checksum);
+    }
+
+    // Write slice table
+    struct evo_slice_table table;
+    table.num_slices = num_slices;
+    table.table_checksum = evo_slice_table_checksum(&header, metadata, slices, num_slices);
+    if (write_checksummed(output_fd, slices, (size_t)num_slices * sizeof(struct evo_slice), &ctx) == -1 ||
+        write_checksummed(output_fd, &table, sizeof(table), &ctx) == -1) {
+        perror("Error writing slice table");
+        evo_output_abort(&output);
         return 1;
     }
 
-    // Read from the output file for checksum calculation
-    ssize_t total_bytes_read = 0;
-    while (bytes_to_read > 0 && (bytes_read = read(output_fd, buffer, BUFFER_SIZE)) > 0) {
-        uint32_t chunk_checksum = crc32(buffer, bytes_read);
-        calculated_checksum = chunk_checksum ^ calculated_checksum;
-        total_bytes_read += bytes_read;
-        bytes_to_read -= bytes_read;
-        printf("Bytes read for checksum: %zd (Remaining: %ld)\n", bytes_read, bytes_to_read);
-        printf("Chunk checksum: 0x%08x, Current calculated checksum: 0x%08x\n", chunk_checksum, calculated_checksum);
+    struct evo_footer footer;
+    footer.checksum = evo_checksum_final(&ctx);
+    if (write(output_fd, &footer, sizeof(footer)) != sizeof(footer)) {
+        perror("Error writing footer");
+        evo_output_abort(&output);
+        return 1;
     }
+    printf("Footer data: checksum=%u\n", footer.checksum);
 
-    if (bytes_read == -1) {
-        perror("Error reading data for checksum calculation");
-        close(input_fd);
-        close(output_fd);
+    if (evo_output_publish(&output) == -1) {
+        perror("Error publishing output file");
         return 1;
     }
+    save_chunks(output_file, package_size, &ctx);
 
-    printf("Calculated checksum (before final XOR): 0x%08x\n", calculated_checksum);
-    uint32_t intermediate_checksum = calculated_checksum;
-    calculated_checksum = ~calculated_checksum;
-    printf("Intermediate checksum: 0x%08x\n", intermediate_checksum);
-    printf("Calculated checksum (after final XOR): 0x%08x\n", calculated_checksum);
-    printf("Total bytes read for checksum: %zd\n", total_bytes_read);
-    printf("Final checksum in hexadecimal: 0x%08x\n", calculated_checksum);
-    printf("Final checksum in decimal: %u\n", calculated_checksum);
+    printf("Successfully created %s with %u slices\n", output_file, num_slices);
+    return 0;
+}
 
-    // Seek back to the end of the file for writing the footer
-    if (lseek(output_fd, 0, SEEK_END) == -1) {
-        perror("Error seeking to end of file after checksum calculation");
-        close(input_fd);
-        close(output_fd);
+struct tree_input {
+    char *path;           // Relative to the input directory
+    char *target;         // Symlink target
+    uint32_t mode;
+    uint64_t size;
+};
+
+static struct {
+    struct tree_input *files;
+    uint32_t count, capacity;
+    size_t root_length;
+} tree_walk;
+
+int collect_tree_entry(const char *path, const struct stat *path_stat, int type, struct FTW *ftw) {
+    (void)type;
+    if (ftw->level == 0)
+        return 0;
+    if (!(S_ISREG(path_stat->st_mode) || S_ISDIR(path_stat->st_mode) || S_ISLNK(path_stat->st_mode))) {
+        fprintf(stderr, "Skipping special file %s\n", path);
+        return 0;
+    }
+    if (tree_walk.count == tree_walk.capacity) {
+        tree_walk.capacity = tree_walk.capacity ? tree_walk.capacity * 2 : 256;
+        struct tree_input *grown = realloc(tree_walk.files, tree_walk.capacity * sizeof(*grown));
+        if (grown == NULL)
+            return -1;
+        tree_walk.files = grown;
+    }
+    struct tree_input *file = &tree_walk.files[tree_walk.count];
+    memset(file, 0, sizeof(*file));
+    file->path = strdup(path + tree_walk.root_length + 1);
+    file->mode = path_stat->st_mode;
+    if (file->path == NULL)
+        return -1;
+    if (!evo_safe_path(file->path)) {
+        fprintf(stderr, "Unsupported file name: %s\n", path);
+        errno = EINVAL;
+        return -1;
+    }
+    if (S_ISREG(path_stat->st_mode)) {
+        file->size = path_stat->st_size;
+    } else if (S_ISLNK(path_stat->st_mode)) {
+        char target[PATH_MAX];
+        ssize_t length = readlink(path, target, sizeof(target) - 1);
+        if (length == -1)
+            return -1;
+        target[length] = '\0';
+        file->target = strdup(target);
+        file->size = length;
+        if (file->target == NULL)
+            return -1;
+    }
+    tree_walk.count++;
+    return 0;
+}
+
+int compare_tree_inputs(const void *a, const void *b) {
+    return strcmp(((const struct tree_input *)a)->path, ((const struct tree_input *)b)->path);
+}
+
+// Package a directory tree, recording a digest for every file
+int create_tree_package(const char *input_dir, const char *output_file, evo_metadata *metadata) {
+    static char buffer[BUFFER_SIZE];
+    tree_walk.root_length = strlen(input_dir);
+    while (tree_walk.root_length > 1 && input_dir[tree_walk.root_length - 1] == '/')
+        tree_walk.root_length--;
+    if (nftw(input_dir, collect_tree_entry, 64, FTW_PHYS) != 0) {
+        perror("Error walking input directory");
         return 1;
     }
+    qsort(tree_walk.files, tree_walk.count, sizeof(struct tree_input), compare_tree_inputs);
 
-    // No need to seek to the end of the file, as we're already at the end after writing all the data
+    uint32_t num_files = tree_walk.count;
+    struct evo_file_entry *entries = calloc(num_files ? num_files : 1, sizeof(struct evo_file_entry));
+    if (entries == NULL) {
+        perror("Error allocating file table");
+        return 1;
+    }
+    uint64_t contents_size = 0;
+    uint64_t paths_size = 0;
+    for (uint32_t i = 0; i < num_files; i++) {
+        entries[i].offset = contents_size;
+        entries[i].size = tree_walk.files[i].size;
+        entries[i].mode = tree_walk.files[i].mode;
+        entries[i].path_offset = paths_size;
+        contents_size += tree_walk.files[i].size;
+        paths_size += strlen(tree_walk.files[i].path) + 1;
+    }
+    if (paths_size == 0)
+        paths_size = 1;  // The path table always ends with a NUL
+    if (paths_size > UINT32_MAX) {
+        fprintf(stderr, "Too many files\n");
+        free(entries);
+        return 1;
+    }
+    char *paths = calloc(paths_size, 1);
+    if (paths == NULL) {
+        perror("Error allocating path table");
+        free(entries);
+        return 1;
+    }
+    for (uint32_t i = 0; i < num_files; i++)
+        strcpy(paths + entries[i].path_offset, tree_walk.files[i].path);
+    metadata->installed_size = contents_size;
 
-    // Prepare and write footer
-    struct evo_footer footer;
-    footer.checksum = calculated_checksum;
-    printf("Preparing footer with checksum: %u\n", footer.checksum);
+    struct evo_header header;
+    memcpy(header.magic, EVO_MAGIC, sizeof(header.magic));
+    header.version = EVO_VERSION_TREE;
+    header.metadata_size = sizeof(evo_metadata);
+    header.data_size = contents_size + (uint64_t)num_files * sizeof(struct evo_file_entry) +
+                       paths_size + sizeof(struct evo_file_table);
 
-    // No need to seek to the end of the file, as we're already at the end after writing all the data
+    struct evo_output output;
+    if (evo_output_open(&output, output_file) == -1) {
+        perror("Error opening output file");
+        free(entries);
+        free(paths);
+        return 1;
+    }
+    int output_fd = output.fd;
+
+    static struct evo_checksum ctx;
+    evo_checksum_init(&ctx);
+    uint64_t package_size = sizeof(header) + header.metadata_size + header.data_size + sizeof(struct evo_footer);
+    if (record_chunks(&ctx, package_size) == -1 ||
+        write_checksummed(output_fd, &header, sizeof(header), &ctx) == -1 ||
+        write_checksummed(output_fd, metadata, sizeof(*metadata), &ctx) == -1) {
+        perror("Error writing header");
+        free(entries);
+        free(paths);
+        evo_output_abort(&output);
+        return 1;
+    }
 
-    ssize_t footer_bytes_written = write(output_fd, &footer, sizeof(footer));
-    if (footer_bytes_written != sizeof(footer)) {
-        perror("Error writing footer");
-        printf("Expected to write %zu bytes, but wrote %zd bytes\n", sizeof(footer), footer_bytes_written);
-        close(input_fd);
-        close(output_fd);
+    // Copy file contents, digesting each file as it goes by
+    for (uint32_t i = 0; i < num_files; i++) {
+        struct tree_input *file = &tree_walk.files[i];
+        struct evo_sha256 sha;
+        evo_sha256_init(&sha);
+        if (S_ISLNK(file->mode)) {
+            evo_sha256_update(&sha, file->target, file->size);
+            if (write_checksummed(output_fd, file->target, file->size, &ctx) == -1) {
+                perror("Error writing data");
+                free(entries);
+                free(paths);
+                evo_output_abort(&output);
+                return 1;
+            }
+        } else if (S_ISREG(file->mode)) {
+            char path[PATH_MAX];
+            snprintf(path, sizeof(path), "%.*s/%s", (int)tree_walk.root_length, input_dir, file->path);
+            int input_fd = open(path, O_RDONLY);
+            if (input_fd == -1) {
+                perror(path);
+                free(entries);
+                free(paths);
+                evo_output_abort(&output);
+                return 1;
+            }
+            uint64_t remaining = file->size;
+            while (remaining > 0) {
+                size_t chunk = remaining < BUFFER_SIZE ? (size_t)remaining : BUFFER_SIZE;
+                ssize_t bytes_read = read(input_fd, buffer, chunk);
+                if (bytes_read <= 0 || write_checksummed(output_fd, buffer, bytes_read, &ctx) == -1) {
+                    fprintf(stderr, "Error copying %s (changed while packaging?)\n", path);
+                    close(input_fd);
+                    free(entries);
+                    free(paths);
+                    evo_output_abort(&output);
+                    return 1;
+                }
+                evo_sha256_update(&sha, buffer, bytes_read);
+                remaining -= bytes_read;
+            }
+            close(input_fd);
+        }
+        evo_sha256_final(&sha, entries[i].digest);
+    }
+
+    // Write file table
+    struct evo_file_table table;
+    static struct evo_checksum table_ctx;
+    memset(&table, 0, sizeof(table));
+    table.num_files = num_files;
+    table.path_table_size = paths_size;
+    evo_checksum_init(&table_ctx);
+    evo_checksum_update(&table_ctx, entries, (size_t)num_files * sizeof(struct evo_file_entry));
+    evo_checksum_update(&table_ctx, paths, paths_size);
+    table.table_checksum = evo_checksum_final(&table_ctx);
+    if (write_checksummed(output_fd, entries, (size_t)num_files * sizeof(struct evo_file_entry), &ctx) == -1 ||
+        write_checksummed(output_fd, paths, paths_size, &ctx) == -1 ||
+        write_checksummed(output_fd, &table, sizeof(table), &ctx) == -1) {
+        perror("Error writing file table");
+        free(entries);
+        free(paths);
+        evo_output_abort(&output);
         return 1;
     }
-    off_t final_size = lseek(output_fd, 0, SEEK_END);
-    if (final_size == -1) {
-        perror("Error getting final file size");
-        close(input_fd);
-        close(output_fd);
+    free(entries);
+    free(paths);
+
+    struct evo_footer footer;
+    footer.checksum = evo_checksum_final(&ctx);
+    if (write(output_fd, &footer, sizeof(footer)) != sizeof(footer)) {
+        perror("Error writing footer");
+        evo_output_abort(&output);
         return 1;
     }
-    printf("Footer written successfully. Final file size: %ld bytes\n", final_size);
     printf("Footer data: checksum=%u\n", footer.checksum);
 
-    // Close files
-    printf("Closing file descriptors. input_fd: %d, output_fd: %d\n", input_fd, output_fd);
-    if (close(input_fd) == -1) {
-        perror("Error closing input file");
-    }
-    if (close(output_fd) == -1) {
-        perror("Error closing output file");
+    if (evo_output_publish(&output) == -1) {
+        perror("Error publishing output file");
         return 1;
     }
+    save_chunks(output_file, package_size, &ctx);
 
-    printf("Successfully created %s\n", output_file);
+    printf("Successfully created %s with %u files (%lu bytes)\n", output_file, num_files, contents_size);
     return 0;
 }
 
+int collect_extents(int fd, off_t size, struct evo_extent **extents, uint32_t *num_extents) {
+    uint32_t capacity = 16;
+    *num_extents = 0;
+    *extents = malloc(capacity * sizeof(struct evo_extent));
+    if (*extents == NULL)
+        return -1;
+
+    off_t position = 0;
+    while (position < size) {
+        off_t data = lseek(fd, position, SEEK_DATA);
+        if (data == -1) {
+            if (errno == ENXIO)
+                break;  // Only a hole remains up to the end of the file
+            if (errno != EINVAL) {
+                free(*extents);
+                return -1;
+            }
+            // SEEK_DATA is not supported here: treat the rest as data
+            data = position;
+        }
+        off_t hole = lseek(fd, data, SEEK_HOLE);
+        if (hole == -1 || hole > size)
+            hole = size;
+
+        if (*num_extents == capacity) {
+            capacity *= 2;
+            struct evo_extent *grown = realloc(*extents, capacity * sizeof(struct evo_extent));
+            if (grown == NULL) {
+                free(*extents);
+                return -1;
+            }
+            *extents = grown;
+        }
+        (*extents)[*num_extents].offset = data;
+        (*extents)[*num_extents].length = hole - data;
+        (*num_extents)++;
+        position = hole;
+    }
+    return 0;
+}
+
+int write_checksummed(int fd, const void *data, size_t length, struct evo_checksum *ctx) {
+    if (write(fd, data, length) != (ssize_t)length)
+        return -1;
+    evo_checksum_update(ctx, data, length);
+    return 0;
+}
+
+int record_chunks(struct evo_checksum *ctx, uint64_t package_size) {
+    if (!chunk_index)
+        return 0;
+    chunk_crcs = malloc(evo_chunk_count(package_size) * sizeof(uint32_t) + 1);
+    if (chunk_crcs == NULL)
+        return -1;
+    evo_checksum_record(ctx, chunk_crcs);
+    return 0;
+}
+
+// The index is only a cache for evo-repair, so failing to save it does not
+// fail the package
+void save_chunks(const char *output_file, uint64_t package_size, const struct evo_checksum *ctx) {
+    if (chunk_crcs == NULL)
+        return;
+    if (ctx->num_crcs != evo_chunk_count(package_size) ||
+        evo_chunks_save(output_file, package_size, chunk_crcs) == -1)
+        fprintf(stderr, "Warning: could not write the chunk index for %s\n", output_file);
+    free(chunk_crcs);
+    chunk_crcs = NULL;
+}
+
 void parse_supported_architectures(evo_metadata *metadata, const char *architectures) {
     char *token = strtok((char *)architectures, ",");
     while (token != NULL && metadata->num_supported_architectures < EVO_MAX_ARCHITECTURES) {
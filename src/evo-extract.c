@@ -0,0 +1,352 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include "evo_format.h"
+#include "evo_metadata.h"
+#include "evo_checksum.h"
+#include "evo_slice.h"
+#include "evo_install.h"
+#include "evo_output.h"
+
+#define BUFFER_SIZE (1024 * 1024)
+
+void print_usage(const char *program_name) {
+    fprintf(stderr, "Usage: %s --input <input_file.evo> --output <output_file> [--arch <architecture>]\n", program_name);
+    fprintf(stderr, "Sliced packages are extracted into the --output directory, one file per slice.\n");
+    fprintf(stderr, "File-tree packages are extracted into the --output directory.\n");
+}
+
+uint32_t crc32(const void *data, size_t length) {
+    uint32_t crc = 0xffffffff;
+    const uint8_t *p = (const uint8_t *)data;
+    while (length--) {
+        crc ^= *p++;
+        for (int i = 0; i < 8; i++)
+            crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+    }
+    return ~crc;
+}
+
+int read_checksummed(int fd, void *data, size_t length, struct evo_checksum *ctx) {
+    if (read(fd, data, length) != (ssize_t)length)
+        return -1;
+    evo_checksum_update(ctx, data, length);
+    return 0;
+}
+
+// Write one slice to <directory>/<architecture>, verifying it on the way
+int extract_slice(int input_fd, const struct evo_header *header, const struct evo_slice *slice,
+                  const char *directory, char *buffer) {
+    char path[4096];
+    if (snprintf(path, sizeof(path), "%s/%s", directory, slice->architecture) >= (int)sizeof(path)) {
+        fprintf(stderr, "Output path too long\n");
+        return -1;
+    }
+    int output_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (output_fd == -1) {
+        perror(path);
+        return -1;
+    }
+
+    struct evo_checksum ctx;
+    evo_checksum_init(&ctx);
+    uint64_t offset = evo_data_offset(header) + slice->offset;
+    uint64_t remaining = slice->size;
+    while (remaining > 0) {
+        size_t chunk = remaining < BUFFER_SIZE ? (size_t)remaining : BUFFER_SIZE;
+        ssize_t bytes_read = pread(input_fd, buffer, chunk, offset);
+        if (bytes_read <= 0 || write(output_fd, buffer, bytes_read) != bytes_read) {
+            fprintf(stderr, "Error extracting slice %s\n", slice->architecture);
+            close(output_fd);
+            unlink(path);
+            return -1;
+        }
+        evo_checksum_update(&ctx, buffer, bytes_read);
+        offset += bytes_read;
+        remaining -= bytes_read;
+    }
+
+    uint32_t calculated_checksum = evo_checksum_final(&ctx);
+    if (calculated_checksum != slice->checksum) {
+        fprintf(stderr, "Slice %s checksum verification: FAILED\n", slice->architecture);
+        close(output_fd);
+        unlink(path);
+        return -1;
+    }
+    if (close(output_fd) == -1) {
+        perror(path);
+        return -1;
+    }
+    printf("Extracted slice %s to %s (%lu bytes, checksum 0x%08X)\n",
+           slice->architecture, path, slice->size, calculated_checksum);
+    return 0;
+}
+
+// Sliced packages extract into a directory, one file per slice. With an
+// architecture, only that slice and the shared slice are read.
+int extract_slices(int input_fd, const struct evo_header *header, const char *directory,
+                   const char *architecture, char *buffer) {
+    struct evo_slice_table table;
+    struct evo_slice *slices;
+    if (evo_load_slices(input_fd, header, &table, &slices) == -1) {
+        fprintf(stderr, "Error reading slice table\n");
+        return 1;
+    }
+    if (architecture != NULL && evo_find_slice(slices, table.num_slices, architecture) == NULL) {
+        fprintf(stderr, "No slice for architecture %s\n", architecture);
+        free(slices);
+        return 1;
+    }
+    if (mkdir(directory, 0755) == -1 && errno != EEXIST) {
+        perror("Error creating output directory");
+        free(slices);
+        return 1;
+    }
+
+    for (uint32_t i = 0; i < table.num_slices; i++) {
+        if (architecture != NULL && strcmp(slices[i].architecture, architecture) != 0 &&
+            strcmp(slices[i].architecture, EVO_SLICE_SHARED) != 0)
+            continue;
+        if (extract_slice(input_fd, header, &slices[i], directory, buffer) == -1) {
+            free(slices);
+            return 1;
+        }
+    }
+    free(slices);
+    printf("Checksum verification: PASSED\n");
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    char *input_file = NULL;
+    char *output_file = NULL;
+    char *architecture = NULL;
+    static char buffer[BUFFER_SIZE];
+
+    // Parse command-line arguments
+    for (int i = 1; i < argc; i += 2) {
+        if (i + 1 >= argc) {
+            print_usage(argv[0]);
+            return 1;
+        }
+        if (strcmp(argv[i], "--input") == 0) {
+            input_file = argv[i + 1];
+        } else if (strcmp(argv[i], "--output") == 0) {
+            output_file = argv[i + 1];
+        } else if (strcmp(argv[i], "--arch") == 0) {
+            architecture = argv[i + 1];
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (input_file == NULL || output_file == NULL) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    // Open input file
+    int input_fd = evo_open_package(input_file, O_RDONLY);
+    if (input_fd == -1) {
+        perror("Error opening input file");
+        return 1;
+    }
+
+    // The package checksum is verified in the same pass that extracts it
+    static struct evo_checksum ctx;
+    evo_checksum_init(&ctx);
+
+    // Read header
+    struct evo_header header;
+    if (read_checksummed(input_fd, &header, sizeof(header), &ctx) == -1) {
+        perror("Error reading header");
+        close(input_fd);
+        return 1;
+    }
+
+    // Verify magic number
+    if (memcmp(header.magic, EVO_MAGIC, sizeof(header.magic)) != 0) {
+        fprintf(stderr, "Invalid EVO file format\n");
+        close(input_fd);
+        return 1;
+    }
+
+    // Read metadata
+    if (header.metadata_size > BUFFER_SIZE ||
+        read_checksummed(input_fd, buffer, header.metadata_size, &ctx) == -1) {
+        perror("Error reading metadata");
+        close(input_fd);
+        return 1;
+    }
+    off_t data_offset = evo_data_offset(&header);
+
+    if (header.version == EVO_VERSION_SLICED) {
+        int result = extract_slices(input_fd, &header, output_file, architecture, buffer);
+        close(input_fd);
+        return result;
+    }
+
+    // File trees are written out in full, each file checked against its digest
+    if (header.version == EVO_VERSION_TREE) {
+        struct evo_install_stats stats;
+        long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+        int result = evo_install_tree(input_fd, &header, output_file, NULL, jobs > 0 ? jobs : 1, &stats);
+        close(input_fd);
+        if (result == -1)
+            return 1;
+        printf("Successfully extracted %u files (%lu bytes) to %s\n", stats.written, stats.bytes_written, output_file);
+        return 0;
+    }
+
+    // Load the extent map. Plain packages are a single extent covering the
+    // whole data section.
+    struct evo_extent_table table;
+    struct evo_extent *extents = NULL;
+    size_t map_size = 0;
+    if (header.version == EVO_VERSION_SPARSE) {
+        if (header.data_size < sizeof(table) ||
+            pread(input_fd, &table, sizeof(table), data_offset + header.data_size - sizeof(table)) != sizeof(table)) {
+            fprintf(stderr, "Error reading extent table\n");
+            close(input_fd);
+            return 1;
+        }
+        map_size = (size_t)table.num_extents * sizeof(struct evo_extent);
+        if (table.reserved != 0 || map_size + sizeof(table) > header.data_size) {
+            fprintf(stderr, "Invalid extent table\n");
+            close(input_fd);
+            return 1;
+        }
+        extents = malloc(map_size > 0 ? map_size : 1);
+        if (extents == NULL ||
+            pread(input_fd, extents, map_size, data_offset + header.data_size - sizeof(table) - map_size) != (ssize_t)map_size) {
+            perror("Error reading extent map");
+            free(extents);
+            close(input_fd);
+            return 1;
+        }
+    } else {
+        table.image_size = header.data_size;
+        table.num_extents = 1;
+        table.reserved = 0;
+        extents = malloc(sizeof(struct evo_extent));
+        if (extents == NULL) {
+            perror("Error allocating extent map");
+            close(input_fd);
+            return 1;
+        }
+        extents[0].offset = 0;
+        extents[0].length = header.data_size;
+    }
+
+    // Open output file
+    int output_fd = open(output_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (output_fd == -1) {
+        perror("Error opening output file");
+        free(extents);
+        close(input_fd);
+        return 1;
+    }
+
+    // Copy every extent to its place in the image. The gaps are never
+    // written, so the output ends up with the same holes as the original.
+    uint64_t image_position = 0;
+    uint64_t payload_size = 0;
+    for (uint32_t i = 0; i < table.num_extents; i++) {
+        uint64_t offset = extents[i].offset;
+        uint64_t remaining = extents[i].length;
+        if (offset < image_position || offset > table.image_size || remaining > table.image_size - offset) {
+            fprintf(stderr, "Invalid extent %u\n", i);
+            free(extents);
+            close(input_fd);
+            close(output_fd);
+            unlink(output_file);
+            return 1;
+        }
+        payload_size += remaining;
+        while (remaining > 0) {
+            size_t chunk = remaining < BUFFER_SIZE ? (size_t)remaining : BUFFER_SIZE;
+            ssize_t bytes_read = read(input_fd, buffer, chunk);
+            if (bytes_read <= 0) {
+                fprintf(stderr, "Error reading package data\n");
+                free(extents);
+                close(input_fd);
+                close(output_fd);
+                unlink(output_file);
+                return 1;
+            }
+            if (pwrite(output_fd, buffer, bytes_read, offset) != bytes_read) {
+                perror("Error writing output file");
+                free(extents);
+                close(input_fd);
+                close(output_fd);
+                unlink(output_file);
+                return 1;
+            }
+            evo_checksum_update(&ctx, buffer, bytes_read);
+            offset += bytes_read;
+            remaining -= bytes_read;
+        }
+        image_position = offset;
+    }
+
+    if (header.version == EVO_VERSION_SPARSE) {
+        if (payload_size + map_size + sizeof(table) != header.data_size) {
+            fprintf(stderr, "Extent map does not match data size\n");
+            free(extents);
+            close(input_fd);
+            close(output_fd);
+            unlink(output_file);
+            return 1;
+        }
+        evo_checksum_update(&ctx, extents, map_size);
+        evo_checksum_update(&ctx, &table, sizeof(table));
+    }
+    free(extents);
+
+    // Extend the image over any trailing hole
+    if (ftruncate(output_fd, table.image_size) == -1) {
+        perror("Error setting output file size");
+        close(input_fd);
+        close(output_fd);
+        unlink(output_file);
+        return 1;
+    }
+
+    // Verify the footer checksum
+    struct evo_footer footer;
+    if (pread(input_fd, &footer, sizeof(footer), data_offset + header.data_size) != sizeof(footer)) {
+        perror("Error reading footer");
+        close(input_fd);
+        close(output_fd);
+        unlink(output_file);
+        return 1;
+    }
+    uint32_t calculated_checksum = evo_checksum_final(&ctx);
+    printf("Calculated checksum: 0x%08X (%u)\n", calculated_checksum, calculated_checksum);
+    printf("Stored checksum:     0x%08X (%u)\n", footer.checksum, footer.checksum);
+    if (calculated_checksum != footer.checksum) {
+        fprintf(stderr, "Checksum verification: FAILED\n");
+        close(input_fd);
+        close(output_fd);
+        unlink(output_file);
+        return 1;
+    }
+    printf("Checksum verification: PASSED\n");
+
+    // Close files
+    close(input_fd);
+    if (close(output_fd) == -1) {
+        perror("Error closing output file");
+        return 1;
+    }
+
+    printf("Successfully extracted %s (%lu bytes)\n", output_file, table.image_size);
+    return 0;
+}
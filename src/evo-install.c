@@ -0,0 +1,108 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include "evo_format.h"
+#include "evo_metadata.h"
+#include "evo_install.h"
+#include "evo_output.h"
+
+void print_usage(const char *program_name) {
+    fprintf(stderr, "Usage: %s --input <input_file.evo> --root <install_dir> [--manifest <manifest_file>] [--jobs <threads>]\n", program_name);
+    fprintf(stderr, "The manifest defaults to <install_dir>/.evo-manifest\n");
+}
+
+uint32_t crc32(const void *data, size_t length) {
+    uint32_t crc = 0xffffffff;
+    const uint8_t *p = (const uint8_t *)data;
+    while (length--) {
+        crc ^= *p++;
+        for (int i = 0; i < 8; i++)
+            crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+    }
+    return ~crc;
+}
+
+int main(int argc, char *argv[]) {
+    char *input_file = NULL;
+    char *root = NULL;
+    char *manifest_file = NULL;
+    long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+
+    // Parse command-line arguments
+    for (int i = 1; i < argc; i += 2) {
+        if (i + 1 >= argc) {
+            print_usage(argv[0]);
+            return 1;
+        }
+        if (strcmp(argv[i], "--input") == 0) {
+            input_file = argv[i + 1];
+        } else if (strcmp(argv[i], "--root") == 0) {
+            root = argv[i + 1];
+        } else if (strcmp(argv[i], "--manifest") == 0) {
+            manifest_file = argv[i + 1];
+        } else if (strcmp(argv[i], "--jobs") == 0) {
+            jobs = atol(argv[i + 1]);
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (input_file == NULL || root == NULL || jobs < 1) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    char default_manifest[PATH_MAX];
+    if (manifest_file == NULL) {
+        snprintf(default_manifest, sizeof(default_manifest), "%s/" EVO_MANIFEST_NAME, root);
+        manifest_file = default_manifest;
+    }
+
+    // Open input file
+    int input_fd = evo_open_package(input_file, O_RDONLY);
+    if (input_fd == -1) {
+        perror("Error opening input file");
+        return 1;
+    }
+
+    // Read header
+    struct evo_header header;
+    if (read(input_fd, &header, sizeof(header)) != sizeof(header)) {
+        perror("Error reading header");
+        close(input_fd);
+        return 1;
+    }
+
+    // Verify magic number
+    if (memcmp(header.magic, EVO_MAGIC, sizeof(header.magic)) != 0) {
+        fprintf(stderr, "Invalid EVO file format\n");
+        close(input_fd);
+        return 1;
+    }
+    if (header.version != EVO_VERSION_TREE) {
+        fprintf(stderr, "Package does not contain a file tree; use evo-extract\n");
+        close(input_fd);
+        return 1;
+    }
+
+    // Only changed files are read from the package, and each is checked
+    // against its own digest as it is written
+    struct evo_install_stats stats;
+    if (evo_install_tree(input_fd, &header, root, manifest_file, (unsigned)jobs, &stats) == -1) {
+        fprintf(stderr, "Installation of %s failed\n", input_file);
+        close(input_fd);
+        return 1;
+    }
+    close(input_fd);
+
+    printf("Installed %s into %s\n", input_file, root);
+    printf("Files written: %u (%lu bytes)\n", stats.written, stats.bytes_written);
+    printf("Files unchanged: %u\n", stats.unchanged);
+    printf("Files removed: %u\n", stats.removed);
+    return 0;
+}
@@ -1,15 +1,26 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <stdint.h>
+#include <stddef.h>
+#include <errno.h>
+#include <glob.h>
+#include <pthread.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
 #include "evo_format.h"
 #include "evo_metadata.h"
+#include "evo_checksum.h"
+#include "evo_output.h"
+#include "evo_chunks.h"
+#include "evo_slice.h"
 
-#define BUFFER_SIZE 4096
-#define MAX_LINE_LENGTH 1024
+#define BUFFER_SIZE (1024 * 1024)
+#define MAX_LINE_LENGTH 4096
 #define MIN(a,b) ((a) < (b) ? (a) : (b))
 
 uint32_t crc32(const void *data, size_t length) {
@@ -27,235 +38,634 @@ uint32_t crc32(const void *data, size_t length) {
 
 void print_usage(const char *program_name) {
     fprintf(stderr, "Usage: %s --input <input_file.evo> --changes <changes_file> --output <output_file.evo>\n", program_name);
+    fprintf(stderr, "       %s --changes <changes_file> [--input <file.evo>]... [--glob <pattern>]... [--jobs <threads>]\n", program_name);
+    fprintf(stderr, "Without --output, every package is modified in place.\n");
+    fprintf(stderr, "Changes are key=value lines; list fields take comma-separated values and\n");
+    fprintf(stderr, "key+=value appends to a list instead of replacing it, and key= with no\n");
+    fprintf(stderr, "value clears a string or list field.\n");
 }
 
+// Every evo_metadata field that a change set can set
+enum field_kind {
+    FIELD_STRING,
+    FIELD_U32,
+    FIELD_U64,
+    FIELD_LIST
+};
+
+struct field {
+    const char *name;
+    enum field_kind kind;
+    size_t offset;        // Offset of the field in evo_metadata
+    size_t length;        // Size of one string element
+    size_t count_offset;  // Offset of the element count for lists
+    uint32_t max_count;   // Capacity of the list
+};
+
+static const struct field fields[] = {
+    {"name", FIELD_STRING, offsetof(evo_metadata, name), EVO_MAX_NAME_LENGTH, 0, 0},
+    {"version", FIELD_STRING, offsetof(evo_metadata, version), EVO_MAX_VERSION_LENGTH, 0, 0},
+    {"description", FIELD_STRING, offsetof(evo_metadata, description), EVO_MAX_DESCRIPTION_LENGTH, 0, 0},
+    {"architecture", FIELD_U32, offsetof(evo_metadata, architecture), 0, 0, 0},
+    {"installed_size", FIELD_U64, offsetof(evo_metadata, installed_size), 0, 0, 0},
+    {"maintainer", FIELD_STRING, offsetof(evo_metadata, maintainer), EVO_MAX_NAME_LENGTH, 0, 0},
+    {"dependencies", FIELD_LIST, offsetof(evo_metadata, dependencies), EVO_MAX_DEPENDENCY_LENGTH,
+     offsetof(evo_metadata, num_dependencies), EVO_MAX_DEPENDENCIES},
+    {"package_type", FIELD_U32, offsetof(evo_metadata, package_type), 0, 0, 0},
+    {"supported_architectures", FIELD_LIST, offsetof(evo_metadata, supported_architectures), EVO_MAX_NAME_LENGTH,
+     offsetof(evo_metadata, num_supported_architectures), EVO_MAX_ARCHITECTURES},
+    {"min_screen_width", FIELD_U32, offsetof(evo_metadata, min_screen_size.width), 0, 0, 0},
+    {"min_screen_height", FIELD_U32, offsetof(evo_metadata, min_screen_size.height), 0, 0, 0},
+    {"required_permissions", FIELD_LIST, offsetof(evo_metadata, required_permissions), EVO_MAX_PERMISSION_LENGTH,
+     offsetof(evo_metadata, num_required_permissions), EVO_MAX_PERMISSIONS},
+    {"target_sdk_version", FIELD_U32, offsetof(evo_metadata, target_sdk_version), 0, 0, 0},
+    {"min_os_version", FIELD_STRING, offsetof(evo_metadata, min_os_version), EVO_MAX_VERSION_LENGTH, 0, 0},
+};
+
+#define NUM_FIELDS (sizeof(fields) / sizeof(fields[0]))
+
+// Key lookup goes through a perfect hash: the seed is chosen once at start
+// up so that every field name lands in its own slot, and a lookup is then
+// one hash and one string compare.
+#define FIELD_SLOTS 64
+
+static uint8_t field_slots[FIELD_SLOTS]; // Field index + 1, or 0 for empty
+static uint32_t field_seed;
+
+uint32_t field_hash(const char *key, size_t length, uint32_t seed) {
+    uint32_t hash = 2166136261u ^ seed;
+    for (size_t i = 0; i < length; i++)
+        hash = (hash ^ (uint8_t)key[i]) * 16777619u;
+    return (hash ^ (hash >> 15)) & (FIELD_SLOTS - 1);
+}
 
+void build_field_index(void) {
+    for (field_seed = 0;; field_seed++) {
+        int collision = 0;
+        memset(field_slots, 0, sizeof(field_slots));
+        for (size_t i = 0; i < NUM_FIELDS && !collision; i++) {
+            uint32_t slot = field_hash(fields[i].name, strlen(fields[i].name), field_seed);
+            collision = field_slots[slot] != 0;
+            field_slots[slot] = i + 1;
+        }
+        if (!collision)
+            return;
+    }
+}
 
-int apply_changes(evo_metadata *metadata, const char *changes_file) {
+const struct field *find_field(const char *key, size_t length) {
+    uint8_t index = field_slots[field_hash(key, length, field_seed)];
+    if (index == 0)
+        return NULL;
+    const struct field *field = &fields[index - 1];
+    return strlen(field->name) == length && memcmp(field->name, key, length) == 0 ? field : NULL;
+}
+
+// A change set is compiled once: keys resolved, numbers parsed and lists
+// split, so applying it to each package is only a series of stores
+struct change {
+    const struct field *field;
+    int append;           // key+= on a list
+    char *text;           // FIELD_STRING
+    uint64_t number;      // FIELD_U32, FIELD_U64
+    char **items;         // FIELD_LIST
+    uint32_t num_items;
+};
+
+struct change_set {
+    struct change *changes;
+    size_t count;
+};
+
+int compile_changes(const char *changes_file, struct change_set *set) {
     FILE *file = fopen(changes_file, "r");
     if (!file) {
         perror("Error opening changes file");
         return -1;
     }
 
+    size_t capacity = 0;
+    int line_number = 0;
+    int failed = 0;
     char line[MAX_LINE_LENGTH];
+    set->changes = NULL;
+    set->count = 0;
     while (fgets(line, sizeof(line), file)) {
-        char *key = strtok(line, "=");
-        char *value = strtok(NULL, "\n");
-
-        if (key && value && *value) {
-            if (strcmp(key, "name") == 0) {
-                strncpy(metadata->name, value, EVO_MAX_NAME_LENGTH - 1);
-                metadata->name[EVO_MAX_NAME_LENGTH - 1] = '\0';
-            } else if (strcmp(key, "version") == 0) {
-                strncpy(metadata->version, value, EVO_MAX_VERSION_LENGTH - 1);
-                metadata->version[EVO_MAX_VERSION_LENGTH - 1] = '\0';
-            } else if (strcmp(key, "description") == 0) {
-                strncpy(metadata->description, value, EVO_MAX_DESCRIPTION_LENGTH - 1);
-                metadata->description[EVO_MAX_DESCRIPTION_LENGTH - 1] = '\0';
-            } else if (strcmp(key, "architecture") == 0) {
-                metadata->architecture = atoi(value);
-            } else if (strcmp(key, "installed_size") == 0) {
-                metadata->installed_size = strtoull(value, NULL, 10);
-            } else if (strcmp(key, "maintainer") == 0) {
-                strncpy(metadata->maintainer, value, EVO_MAX_NAME_LENGTH - 1);
-                metadata->maintainer[EVO_MAX_NAME_LENGTH - 1] = '\0';
-            } else if (strcmp(key, "package_type") == 0) {
-                metadata->package_type = atoi(value);
+        line_number++;
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0' || line[0] == '#')
+            continue;
+
+        char *separator = strchr(line, '=');
+        if (separator == NULL || separator == line) {
+            fprintf(stderr, "%s:%d: expected key=value\n", changes_file, line_number);
+            failed = 1;
+            continue;
+        }
+        int append = separator[-1] == '+';
+        const char *value = separator + 1;
+        const struct field *field = find_field(line, separator - line - append);
+        if (field == NULL) {
+            fprintf(stderr, "%s:%d: unknown field '%.*s'\n", changes_file, line_number,
+                    (int)(separator - line - append), line);
+            failed = 1;
+            continue;
+        }
+        if (append && field->kind != FIELD_LIST) {
+            fprintf(stderr, "%s:%d: += only applies to list fields\n", changes_file, line_number);
+            failed = 1;
+            continue;
+        }
+
+        if (set->count == capacity) {
+            capacity = capacity ? capacity * 2 : 16;
+            struct change *grown = realloc(set->changes, capacity * sizeof(struct change));
+            if (grown == NULL) {
+                perror("Error compiling changes");
+                fclose(file);
+                return -1;
             }
-            // Add more fields as needed
+            set->changes = grown;
         }
+        struct change *change = &set->changes[set->count];
+        memset(change, 0, sizeof(*change));
+        change->field = field;
+        change->append = append;
+
+        switch (field->kind) {
+            case FIELD_STRING:
+                change->text = strdup(value);
+                if (change->text == NULL) {
+                    perror("Error compiling changes");
+                    fclose(file);
+                    return -1;
+                }
+                break;
+            case FIELD_U32:
+            case FIELD_U64: {
+                char *end;
+                errno = 0;
+                change->number = strtoull(value, &end, 10);
+                if (end == value || *end != '\0' || errno != 0 || *value == '-' ||
+                    (field->kind == FIELD_U32 && change->number > UINT32_MAX)) {
+                    fprintf(stderr, "%s:%d: invalid number '%s'\n", changes_file, line_number, value);
+                    failed = 1;
+                    continue;
+                }
+                break;
+            }
+            case FIELD_LIST: {
+                char *items = strdup(value);
+                change->items = calloc(field->max_count, sizeof(char *));
+                if (items == NULL || change->items == NULL) {
+                    perror("Error compiling changes");
+                    fclose(file);
+                    return -1;
+                }
+                for (char *token = strtok(items, ","); token != NULL; token = strtok(NULL, ",")) {
+                    if (change->num_items == field->max_count) {
+                        fprintf(stderr, "%s:%d: %s holds at most %u entries\n", changes_file, line_number,
+                                field->name, field->max_count);
+                        failed = 1;
+                        break;
+                    }
+                    change->items[change->num_items++] = token;
+                }
+                break;
+            }
+        }
+        set->count++;
     }
 
     fclose(file);
-    return 0;
+    return failed ? -1 : 0;
 }
 
-int main(int argc, char *argv[]) {
-    char buffer[BUFFER_SIZE];
-    ssize_t bytes_read;
-    char *input_file = NULL;
-    char *changes_file = NULL;
-    char *output_file = NULL;
-
-    // Parse command-line arguments
-    for (int i = 1; i < argc; i += 2) {
-        if (i + 1 >= argc) {
-            print_usage(argv[0]);
-            return 1;
+void apply_changes(evo_metadata *metadata, const struct change_set *set) {
+    char *base = (char *)metadata;
+    for (size_t i = 0; i < set->count; i++) {
+        const struct change *change = &set->changes[i];
+        const struct field *field = change->field;
+        switch (field->kind) {
+            case FIELD_STRING:
+                memset(base + field->offset, 0, field->length);
+                strncpy(base + field->offset, change->text, field->length - 1);
+                break;
+            case FIELD_U32: {
+                uint32_t value = (uint32_t)change->number;
+                memcpy(base + field->offset, &value, sizeof(value));
+                break;
+            }
+            case FIELD_U64:
+                memcpy(base + field->offset, &change->number, sizeof(change->number));
+                break;
+            case FIELD_LIST: {
+                uint32_t count = 0;
+                if (change->append) {
+                    memcpy(&count, base + field->count_offset, sizeof(count));
+                    count = MIN(count, field->max_count);
+                } else {
+                    memset(base + field->offset, 0, (size_t)field->max_count * field->length);
+                }
+                for (uint32_t j = 0; j < change->num_items && count < field->max_count; j++, count++) {
+                    char *slot = base + field->offset + (size_t)count * field->length;
+                    memset(slot, 0, field->length);
+                    strncpy(slot, change->items[j], field->length - 1);
+                }
+                memcpy(base + field->count_offset, &count, sizeof(count));
+                break;
+            }
         }
-        if (strcmp(argv[i], "--input") == 0) {
-            input_file = argv[i + 1];
-        } else if (strcmp(argv[i], "--changes") == 0) {
-            changes_file = argv[i + 1];
-        } else if (strcmp(argv[i], "--output") == 0) {
-            output_file = argv[i + 1];
-        } else {
-            print_usage(argv[0]);
-            return 1;
+    }
+}
+
+// XOR of the chunk crcs over buffer, which starts on a chunk boundary. Each
+// crc is also stored in crcs unless it is NULL.
+uint32_t chunk_crcs(const uint8_t *buffer, size_t length, uint32_t *crcs) {
+    uint32_t value = 0;
+    for (size_t offset = 0; offset < length; offset += EVO_CHECKSUM_CHUNK) {
+        uint32_t crc = crc32(buffer + offset, MIN(EVO_CHECKSUM_CHUNK, length - offset));
+        if (crcs != NULL)
+            crcs[offset / EVO_CHECKSUM_CHUNK] = crc;
+        value ^= crc;
+    }
+    return value;
+}
+
+// Copy a whole package into a new output: a reflink where the filesystem
+// supports it, an in-kernel copy otherwise. Only used when the output is a
+// different file.
+int copy_package(int input_fd, int output_fd, off_t size) {
+    if (ioctl(output_fd, FICLONE, input_fd) == 0)
+        return 0;
+    off_t offset = 0;
+    while (offset < size) {
+        ssize_t copied = copy_file_range(input_fd, &offset, output_fd, NULL, size - offset, 0);
+        if (copied > 0)
+            continue;
+        if (copied == 0 || (errno != EXDEV && errno != ENOSYS && errno != EINVAL && errno != EOPNOTSUPP))
+            return -1;
+        static __thread uint8_t buffer[BUFFER_SIZE];
+        while (offset < size) {
+            ssize_t bytes_read = pread(input_fd, buffer, MIN(BUFFER_SIZE, size - offset), offset);
+            if (bytes_read <= 0 || pwrite(output_fd, buffer, bytes_read, offset) != bytes_read)
+                return -1;
+            offset += bytes_read;
         }
     }
+    return 0;
+}
 
-    if (input_file == NULL || changes_file == NULL || output_file == NULL) {
-        print_usage(argv[0]);
-        return 1;
+// Apply a change set to one package, writing the result to output_file
+// (which may be the input itself). Only the checksum chunks that overlap the
+// header and metadata (and, in sliced packages, the slice table checksum)
+// can change, so the new checksum is derived from the old one by swapping
+// those chunks' crcs, and the data section is never checksummed again. In
+// place, the package is reflinked and replaced where the filesystem allows
+// it; elsewhere only those fields and the footer are rewritten, through a
+// journal. The result is published at once, or only
+// staged in output for a later group commit.
+int modify_package(const char *input_file, const char *output_file, const struct change_set *set,
+                   struct evo_output *output, int publish) {
+    int in_place = strcmp(input_file, output_file) == 0;
+    int recovered = evo_journal_recover(input_file);
+    if (recovered == -1) {
+        fprintf(stderr, "%s: Error recovering interrupted modification: %s\n", input_file, strerror(errno));
+        return -1;
     }
+    if (recovered == 1)
+        printf("Recovered interrupted modification of %s\n", input_file);
 
-    // Open input file
     int input_fd = open(input_file, O_RDONLY);
     if (input_fd == -1) {
-        perror("Error opening input file");
-        return 1;
+        perror(input_file);
+        return -1;
     }
 
-    // Get input file size
     struct stat input_stat;
     if (fstat(input_fd, &input_stat) == -1) {
-        perror("Error getting input file size");
+        perror(input_file);
         close(input_fd);
-        return 1;
+        return -1;
+    }
+    off_t content_size = input_stat.st_size - (off_t)sizeof(struct evo_footer);
+    size_t metadata_end = sizeof(struct evo_header) + sizeof(evo_metadata);
+    if (content_size < (off_t)metadata_end) {
+        fprintf(stderr, "%s: Invalid EVO file format\n", input_file);
+        close(input_fd);
+        return -1;
     }
-    off_t input_file_size = input_stat.st_size;
 
-    // Read header
-    struct evo_header header;
-    if (read(input_fd, &header, sizeof(header)) != sizeof(header)) {
-        perror("Error reading header");
+    // Read every chunk that overlaps the header and metadata
+    size_t region_size = (metadata_end + EVO_CHECKSUM_CHUNK - 1) / EVO_CHECKSUM_CHUNK * EVO_CHECKSUM_CHUNK;
+    region_size = MIN(region_size, (size_t)content_size);
+    uint8_t *region = malloc(region_size);
+    struct evo_footer old_footer;
+    if (region == NULL ||
+        pread(input_fd, region, region_size, 0) != (ssize_t)region_size ||
+        pread(input_fd, &old_footer, sizeof(old_footer), content_size) != sizeof(old_footer)) {
+        fprintf(stderr, "%s: Error reading package\n", input_file);
+        free(region);
         close(input_fd);
-        return 1;
+        return -1;
     }
 
     // Verify magic number
+    struct evo_header header;
+    memcpy(&header, region, sizeof(header));
     if (memcmp(header.magic, EVO_MAGIC, sizeof(header.magic)) != 0) {
-        fprintf(stderr, "Invalid EVO file format\n");
+        fprintf(stderr, "%s: Invalid EVO file format\n", input_file);
+        free(region);
         close(input_fd);
-        return 1;
+        return -1;
     }
 
-    // Read metadata
-    evo_metadata metadata;
-    if (read(input_fd, &metadata, sizeof(metadata)) != sizeof(metadata)) {
-        perror("Error reading metadata");
-        close(input_fd);
-        return 1;
+    // The slice table checksum of a sliced package covers the metadata, so
+    // the chunks holding it change too. They form a tail of their own,
+    // unless the package is small enough for them to join the region.
+    struct evo_slice_table table;
+    struct evo_slice *slices = NULL;
+    off_t table_checksum_offset = content_size - sizeof(table) + offsetof(struct evo_slice_table, table_checksum);
+    off_t tail_offset = table_checksum_offset / EVO_CHECKSUM_CHUNK * EVO_CHECKSUM_CHUNK;
+    size_t tail_size = 0;
+    uint8_t *tail = NULL;
+    if (header.version == EVO_VERSION_SLICED) {
+        if (evo_data_offset(&header) + header.data_size != (uint64_t)content_size ||
+            evo_load_slices(input_fd, &header, &table, &slices) == -1) {
+            fprintf(stderr, "%s: Error reading slice table\n", input_file);
+            free(region);
+            close(input_fd);
+            return -1;
+        }
+        if (tail_offset < (off_t)region_size) {
+            uint8_t *grown = realloc(region, content_size);
+            if (grown == NULL ||
+                pread(input_fd, grown + region_size, content_size - region_size, region_size) !=
+                    (ssize_t)(content_size - region_size)) {
+                fprintf(stderr, "%s: Error reading package\n", input_file);
+                free(grown != NULL ? grown : region);
+                free(slices);
+                close(input_fd);
+                return -1;
+            }
+            region = grown;
+            region_size = content_size;
+        } else {
+            tail_size = content_size - tail_offset;
+            tail = malloc(tail_size);
+            if (tail == NULL || pread(input_fd, tail, tail_size, tail_offset) != (ssize_t)tail_size) {
+                fprintf(stderr, "%s: Error reading package\n", input_file);
+                free(tail);
+                free(region);
+                free(slices);
+                close(input_fd);
+                return -1;
+            }
+        }
     }
 
-    // Read old checksum from footer
-    struct evo_footer old_footer;
-    if (lseek(input_fd, -sizeof(struct evo_footer), SEEK_END) == -1 ||
-        read(input_fd, &old_footer, sizeof(old_footer)) != sizeof(old_footer)) {
-        perror("Error reading old checksum");
-        close(input_fd);
-        return 1;
-    }
+    // A chunk index kept next to the package is carried over by replacing
+    // the crcs of the same chunks
+    uint32_t *index = NULL;
+    evo_chunks_load(input_file, input_stat.st_size, old_footer.checksum, &index);
 
     // Apply changes
-    if (apply_changes(&metadata, changes_file) != 0) {
-        close(input_fd);
-        return 1;
+    evo_metadata metadata;
+    uint32_t old_crcs = chunk_crcs(region, region_size, NULL) ^ chunk_crcs(tail, tail_size, NULL);
+    memcpy(&metadata, region + sizeof(struct evo_header), sizeof(metadata));
+    apply_changes(&metadata, set);
+    memcpy(region + sizeof(struct evo_header), &metadata, sizeof(metadata));
+    if (slices != NULL) {
+        table.table_checksum = evo_slice_table_checksum(&header, &metadata, slices, table.num_slices);
+        uint8_t *field = tail != NULL ? tail + (table_checksum_offset - tail_offset) : region + table_checksum_offset;
+        memcpy(field, &table.table_checksum, sizeof(table.table_checksum));
+        free(slices);
     }
+    uint32_t new_crcs = chunk_crcs(region, region_size, index) ^
+        chunk_crcs(tail, tail_size, index != NULL ? index + tail_offset / EVO_CHECKSUM_CHUNK : NULL);
+    free(region);
+    free(tail);
+    int sliced = header.version == EVO_VERSION_SLICED;
 
-    // Open output file
-    int output_fd = open(output_file, O_RDWR | O_CREAT | O_TRUNC, 0644);
-    if (output_fd == -1) {
-        perror("Error opening output file");
-        close(input_fd);
-        return 1;
-    }
+    struct evo_footer footer;
+    footer.checksum = ~(~old_footer.checksum ^ old_crcs ^ new_crcs);
 
-    // Write header
-    if (write(output_fd, &header, sizeof(header)) != sizeof(header)) {
-        perror("Error writing header");
+    // Write the modified package next to the output and publish it whole
+    if (evo_output_open(output, output_file) == -1) {
+        perror(output_file);
+        free(index);
         close(input_fd);
-        close(output_fd);
-        return 1;
+        return -1;
     }
-
-    // Write updated metadata
-    if (write(output_fd, &metadata, sizeof(metadata)) != sizeof(metadata)) {
-        perror("Error writing metadata");
+    int failed;
+    if (in_place && ioctl(output->fd, FICLONE, input_fd) == -1) {
+        // No reflinks: patch the metadata and footer where they are. The
+        // footer goes last, as the journal identifies the package by it.
+        struct evo_journal_range ranges[3] = {{sizeof(struct evo_header), sizeof(metadata)}};
+        const void *data[3] = {&metadata};
+        uint32_t num_ranges = 1;
+        if (sliced) {
+            ranges[num_ranges] = (struct evo_journal_range){table_checksum_offset, sizeof(table.table_checksum)};
+            data[num_ranges++] = &table.table_checksum;
+        }
+        ranges[num_ranges] = (struct evo_journal_range){content_size, sizeof(footer)};
+        data[num_ranges++] = &footer;
+        evo_output_abort(output);
+        failed = evo_output_patch(output, output_file, input_stat.st_size, ranges, data, num_ranges, publish) == -1;
+    } else {
+        failed = (!in_place && copy_package(input_fd, output->fd, input_stat.st_size) == -1) ||
+            pwrite(output->fd, &metadata, sizeof(metadata), sizeof(struct evo_header)) != sizeof(metadata) ||
+            pwrite(output->fd, &footer, sizeof(footer), content_size) != sizeof(footer) ||
+            (sliced && pwrite(output->fd, &table.table_checksum, sizeof(table.table_checksum),
+                              table_checksum_offset) != sizeof(table.table_checksum)) ||
+            (in_place && fchmod(output->fd, input_stat.st_mode & 07777) == -1) ||
+            (publish ? evo_output_publish(output) : evo_output_stage(output)) == -1;
+    }
+    if (failed) {
+        fprintf(stderr, "%s: Error writing output file: %s\n", output_file, strerror(errno));
+        evo_output_abort(output);
+        free(index);
         close(input_fd);
-        close(output_fd);
-        return 1;
+        return -1;
     }
+    close(input_fd);
+    if (index != NULL && evo_chunks_save(output_file, input_stat.st_size, index) == -1)
+        fprintf(stderr, "%s: Warning: could not update the chunk index\n", output_file);
+    free(index);
 
-    // Copy the rest of the input file content to the output file
-    off_t remaining_bytes = input_file_size - sizeof(struct evo_header) - sizeof(evo_metadata) - sizeof(struct evo_footer);
+    printf("%s %s\n", publish ? "Successfully modified" : "Staged", output_file);
+    printf("Old checksum: 0x%08X (%u)\n", old_footer.checksum, old_footer.checksum);
+    printf("New checksum: 0x%08X (%u)\n", footer.checksum, footer.checksum);
+    return 0;
+}
 
-    while (remaining_bytes > 0 && (bytes_read = read(input_fd, buffer, MIN(BUFFER_SIZE, remaining_bytes))) > 0) {
-        if (write(output_fd, buffer, bytes_read) != bytes_read) {
-            perror("Error writing data to output file");
-            close(input_fd);
-            close(output_fd);
-            return 1;
-        }
-        remaining_bytes -= bytes_read;
-    }
+// A package named more than once (--input twice, ./ prefixes, a glob
+// that overlaps an --input) must be modified by one worker only, so
+// duplicates are dropped by device and inode, keeping the first name
+struct package_id {
+    dev_t dev;
+    ino_t ino;
+    size_t index;
+};
+
+int compare_package_ids(const void *a, const void *b) {
+    const struct package_id *x = a, *y = b;
+    if (x->dev != y->dev)
+        return x->dev < y->dev ? -1 : 1;
+    if (x->ino != y->ino)
+        return x->ino < y->ino ? -1 : 1;
+    return x->index < y->index ? -1 : x->index > y->index;
+}
 
-    if (bytes_read == -1) {
-        perror("Error reading data from input file");
-        close(input_fd);
-        close(output_fd);
-        return 1;
+size_t dedup_packages(char **packages, size_t count) {
+    struct package_id *ids = malloc(count * sizeof(struct package_id));
+    unsigned char *duplicate = calloc(count, 1);
+    size_t num_ids = 0;
+    if (ids == NULL || duplicate == NULL) {
+        free(ids);
+        free(duplicate);
+        return count;
+    }
+    // A package that cannot be stat'ed is kept so that modify_package()
+    // reports the error for it
+    for (size_t i = 0; i < count; i++) {
+        struct stat st;
+        if (stat(packages[i], &st) == 0)
+            ids[num_ids++] = (struct package_id){st.st_dev, st.st_ino, i};
+    }
+    qsort(ids, num_ids, sizeof(struct package_id), compare_package_ids);
+    for (size_t i = 1; i < num_ids; i++) {
+        if (ids[i].dev == ids[i - 1].dev && ids[i].ino == ids[i - 1].ino)
+            duplicate[ids[i].index] = 1;
     }
+    size_t kept = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (!duplicate[i])
+            packages[kept++] = packages[i];
+    }
+    free(ids);
+    free(duplicate);
+    return kept;
+}
 
-    // Calculate checksum for the entire file content, excluding the footer
-    uint32_t calculated_checksum = 0xffffffff;
-    off_t file_size = lseek(output_fd, 0, SEEK_END);
-    if (file_size == -1) {
-        perror("Error getting file size");
-        close(input_fd);
-        close(output_fd);
-        return 1;
+struct batch {
+    char **packages;
+    struct evo_output *outputs;
+    size_t count;
+    size_t next;
+    const struct change_set *set;
+    int failures;
+};
+
+void *modify_worker(void *arg) {
+    struct batch *batch = arg;
+    for (;;) {
+        size_t next = __atomic_fetch_add(&batch->next, 1, __ATOMIC_RELAXED);
+        if (next >= batch->count)
+            break;
+        if (modify_package(batch->packages[next], batch->packages[next], batch->set,
+                           &batch->outputs[next], 0) == -1)
+            __atomic_fetch_add(&batch->failures, 1, __ATOMIC_RELAXED);
     }
+    return NULL;
+}
 
-    // Reset output file pointer to the beginning for checksum calculation
-    if (lseek(output_fd, 0, SEEK_SET) == -1) {
-        perror("Error seeking to beginning of output file for checksum calculation");
-        close(input_fd);
-        close(output_fd);
-        return 1;
+int main(int argc, char *argv[]) {
+    char *changes_file = NULL;
+    char *output_file = NULL;
+    long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    glob_t matches;
+    int globbed = 0;
+    char **packages = NULL;
+    size_t num_packages = 0;
+
+    // Parse command-line arguments
+    for (int i = 1; i < argc; i += 2) {
+        if (i + 1 >= argc) {
+            print_usage(argv[0]);
+            return 1;
+        }
+        if (strcmp(argv[i], "--input") == 0) {
+            char **grown = realloc(packages, (num_packages + 1) * sizeof(char *));
+            if (grown == NULL) {
+                perror("Error parsing arguments");
+                return 1;
+            }
+            packages = grown;
+            packages[num_packages++] = argv[i + 1];
+        } else if (strcmp(argv[i], "--glob") == 0) {
+            int result = glob(argv[i + 1], globbed ? GLOB_APPEND : 0, NULL, &matches);
+            if (result != 0 && result != GLOB_NOMATCH) {
+                fprintf(stderr, "Error expanding %s\n", argv[i + 1]);
+                return 1;
+            }
+            globbed = globbed || result == 0;
+        } else if (strcmp(argv[i], "--changes") == 0) {
+            changes_file = argv[i + 1];
+        } else if (strcmp(argv[i], "--output") == 0) {
+            output_file = argv[i + 1];
+        } else if (strcmp(argv[i], "--jobs") == 0) {
+            jobs = atol(argv[i + 1]);
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
     }
 
-    off_t bytes_to_read = file_size - sizeof(struct evo_footer);
-    while (bytes_to_read > 0 && (bytes_read = read(output_fd, buffer, MIN(BUFFER_SIZE, bytes_to_read))) > 0) {
-        calculated_checksum = crc32(buffer, bytes_read) ^ calculated_checksum;
-        bytes_to_read -= bytes_read;
+    if (globbed) {
+        char **grown = realloc(packages, (num_packages + matches.gl_pathc) * sizeof(char *));
+        if (grown == NULL) {
+            perror("Error parsing arguments");
+            return 1;
+        }
+        packages = grown;
+        for (size_t i = 0; i < matches.gl_pathc; i++)
+            packages[num_packages++] = matches.gl_pathv[i];
     }
+    num_packages = dedup_packages(packages, num_packages);
 
-    if (bytes_read == -1) {
-        perror("Error reading data for checksum calculation");
-        close(input_fd);
-        close(output_fd);
+    if (changes_file == NULL || num_packages == 0 || jobs < 1 || (output_file != NULL && num_packages != 1)) {
+        print_usage(argv[0]);
         return 1;
     }
 
-    calculated_checksum = ~calculated_checksum;
-
-    // Prepare and write footer
-    struct evo_footer footer;
-    footer.checksum = calculated_checksum;
-
-    if (lseek(output_fd, 0, SEEK_END) == -1) {
-        perror("Error seeking to end of file for footer writing");
-        close(input_fd);
-        close(output_fd);
+    // Compile the change set once for every package
+    build_field_index();
+    struct change_set set;
+    if (compile_changes(changes_file, &set) != 0)
         return 1;
+
+    // A single package is flushed on its own; a batch is staged by the
+    // workers and made durable with one group commit
+    if (num_packages == 1) {
+        struct evo_output output;
+        return modify_package(packages[0], output_file ? output_file : packages[0], &set, &output, 1) == 0 ? 0 : 1;
     }
 
-    if (write(output_fd, &footer, sizeof(footer)) != sizeof(footer)) {
-        perror("Error writing footer");
-        close(input_fd);
-        close(output_fd);
+    struct batch batch = {packages, calloc(num_packages, sizeof(struct evo_output)), num_packages, 0, &set, 0};
+    if (batch.outputs == NULL) {
+        perror("Error allocating outputs");
         return 1;
     }
+    if ((size_t)jobs > num_packages)
+        jobs = num_packages;
+    pthread_t *threads = malloc(jobs * sizeof(pthread_t));
+    long started = 0;
+    if (threads != NULL) {
+        for (; started < jobs; started++) {
+            if (pthread_create(&threads[started], NULL, modify_worker, &batch) != 0)
+                break;
+        }
+    }
+    if (started == 0)
+        modify_worker(&batch);
+    for (long t = 0; t < started; t++)
+        pthread_join(threads[t], NULL);
+    free(threads);
 
-    // Close files
-    close(input_fd);
-    close(output_fd);
+    batch.failures += evo_output_commit(batch.outputs, num_packages);
+    free(batch.outputs);
 
-    printf("Successfully modified %s\n", output_file);
-    printf("Old checksum: 0x%08X (%u)\n", old_footer.checksum, old_footer.checksum);
-    printf("New checksum: 0x%08X (%u)\n", calculated_checksum, calculated_checksum);
-    return 0;
+    printf("Modified %zu of %zu packages\n", num_packages - batch.failures, num_packages);
+    return batch.failures ? 1 : 0;
 }
@@ -0,0 +1,1018 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__x86_64__) || defined(__i386__)
+#define EVO_QUERY_AVX2
+#include <immintrin.h>
+#endif
+#include "evo_format.h"
+#include "evo_metadata.h"
+#include "evo_output.h"
+
+// evo-query loads the metadata of many packages into a column store: every
+// string field is interned into a per-column dictionary and rows hold
+// dictionary ids, numeric fields are plain arrays. Filters run over whole
+// columns at a time and produce one bit per package. The store can be saved
+// as an index and memory-mapped back, which avoids reopening every package.
+// Indexes are validated once when they are loaded, so queries can trust
+// every id and offset in them.
+
+#define EVO_INDEX_MAGIC "EVOQIDX"
+#define EVO_INDEX_VERSION 2
+
+// Used by evo_checksum.h, which evo_open_package() needs to recognize a
+// pending journal
+uint32_t crc32(const void *data, size_t length) {
+    uint32_t crc = 0xffffffff;
+    const uint8_t *p = (const uint8_t *)data;
+    while (length--) {
+        crc ^= *p++;
+        for (int i = 0; i < 8; i++)
+            crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+    }
+    return ~crc;
+}
+
+enum column_kind {
+    COLUMN_STRING,      // One interned string per row
+    COLUMN_STRING_LIST, // A list of interned strings per row
+    COLUMN_U32,
+    COLUMN_U64
+};
+
+struct column_def {
+    const char *name;
+    enum column_kind kind;
+    size_t offset;        // Offset of the field in evo_metadata
+    size_t length;        // Length of one string element
+    size_t count_offset;  // Offset of the element count for lists
+    uint32_t max_count;   // Capacity of the list field
+};
+
+#define COLUMN_PATH 0
+#define COLUMN_NAME 1
+#define COLUMN_VERSION 2
+
+static const struct column_def column_defs[] = {
+    {"path", COLUMN_STRING, 0, 0, 0, 0},
+    {"name", COLUMN_STRING, offsetof(evo_metadata, name), EVO_MAX_NAME_LENGTH, 0, 0},
+    {"version", COLUMN_STRING, offsetof(evo_metadata, version), EVO_MAX_VERSION_LENGTH, 0, 0},
+    {"description", COLUMN_STRING, offsetof(evo_metadata, description), EVO_MAX_DESCRIPTION_LENGTH, 0, 0},
+    {"maintainer", COLUMN_STRING, offsetof(evo_metadata, maintainer), EVO_MAX_NAME_LENGTH, 0, 0},
+    {"min_os_version", COLUMN_STRING, offsetof(evo_metadata, min_os_version), EVO_MAX_VERSION_LENGTH, 0, 0},
+    {"dependencies", COLUMN_STRING_LIST, offsetof(evo_metadata, dependencies), EVO_MAX_DEPENDENCY_LENGTH,
+     offsetof(evo_metadata, num_dependencies), EVO_MAX_DEPENDENCIES},
+    {"supported_architectures", COLUMN_STRING_LIST, offsetof(evo_metadata, supported_architectures), EVO_MAX_NAME_LENGTH,
+     offsetof(evo_metadata, num_supported_architectures), EVO_MAX_ARCHITECTURES},
+    {"required_permissions", COLUMN_STRING_LIST, offsetof(evo_metadata, required_permissions), EVO_MAX_PERMISSION_LENGTH,
+     offsetof(evo_metadata, num_required_permissions), EVO_MAX_PERMISSIONS},
+    {"architecture", COLUMN_U32, offsetof(evo_metadata, architecture), 0, 0, 0},
+    {"package_type", COLUMN_U32, offsetof(evo_metadata, package_type), 0, 0, 0},
+    {"target_sdk_version", COLUMN_U32, offsetof(evo_metadata, target_sdk_version), 0, 0, 0},
+    {"min_screen_width", COLUMN_U32, offsetof(evo_metadata, min_screen_size.width), 0, 0, 0},
+    {"min_screen_height", COLUMN_U32, offsetof(evo_metadata, min_screen_size.height), 0, 0, 0},
+    {"installed_size", COLUMN_U64, offsetof(evo_metadata, installed_size), 0, 0, 0},
+};
+
+#define NUM_COLUMNS (sizeof(column_defs) / sizeof(column_defs[0]))
+
+struct column {
+    // Dictionary: string i is pool[offsets[i]] up to its NUL terminator,
+    // and offsets[num_strings] is the end of the pool
+    char *pool;
+    uint64_t pool_size, pool_capacity;
+    uint32_t *offsets;
+    uint32_t num_strings, offsets_capacity;
+    uint32_t *slots;      // Interning hash table of id + 1, also used for exact lookups
+    uint32_t slots_capacity;
+
+    uint32_t *ids;        // COLUMN_STRING
+    uint32_t *list_offsets; // COLUMN_STRING_LIST, num_rows + 1 entries
+    uint32_t *list_ids;
+    uint64_t list_count, list_capacity;
+    uint32_t *u32;        // COLUMN_U32
+    uint64_t *u64;        // COLUMN_U64
+};
+
+struct column_store {
+    struct column columns[NUM_COLUMNS];
+    uint64_t num_rows, rows_capacity;
+};
+
+struct index_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t num_columns;
+    uint64_t num_rows;
+};
+
+struct index_column_header {
+    uint32_t kind;
+    uint32_t num_strings;
+    uint64_t pool_size;
+    uint64_t list_count;
+    uint32_t slots_capacity;
+    uint32_t reserved;
+};
+
+void print_usage(const char *program_name) {
+    fprintf(stderr, "Usage: %s [OPTIONS] [package.evo ...]\n", program_name);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  --index <file>         Load a repository index instead of packages\n");
+    fprintf(stderr, "  --build-index <file>   Save the loaded packages as a repository index\n");
+    fprintf(stderr, "  --where <expression>   Filter, e.g. \"maintainer~alice or target_sdk_version<30\"\n");
+    fprintf(stderr, "  --count                Print only the number of matching packages\n");
+    fprintf(stderr, "Operators: = != ~ (substring) ^= (prefix) < <= > >=; terms are joined with\n");
+    fprintf(stderr, "'and' and 'or', and 'and' binds tighter. List fields match if any element does.\n");
+}
+
+void *grow_array(void *array, uint64_t *capacity, uint64_t needed, size_t element_size) {
+    if (needed <= *capacity)
+        return array;
+    uint64_t new_capacity = *capacity ? *capacity : 64;
+    while (new_capacity < needed)
+        new_capacity *= 2;
+    void *grown = realloc(array, new_capacity * element_size);
+    if (grown == NULL) {
+        perror("Error allocating column");
+        exit(1);
+    }
+    *capacity = new_capacity;
+    return grown;
+}
+
+uint32_t hash_string(const char *s, size_t length) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++)
+        hash = (hash ^ (uint8_t)s[i]) * 16777619u;
+    return hash;
+}
+
+uint32_t string_length(const struct column *column, uint32_t id) {
+    return column->offsets[id + 1] - column->offsets[id] - 1;
+}
+
+// Find the hash table slot that holds s, or the empty slot where it belongs
+uint32_t *find_slot(const struct column *column, const char *s, size_t length) {
+    uint32_t slot = hash_string(s, length) & (column->slots_capacity - 1);
+    while (column->slots[slot] != 0) {
+        uint32_t id = column->slots[slot] - 1;
+        if (string_length(column, id) == length && memcmp(column->pool + column->offsets[id], s, length) == 0)
+            break;
+        slot = (slot + 1) & (column->slots_capacity - 1);
+    }
+    return &column->slots[slot];
+}
+
+uint32_t intern_string(struct column *column, const char *s, size_t length) {
+    if (column->slots_capacity == 0 || (column->num_strings + 1) * 2 > column->slots_capacity) {
+        uint32_t capacity = column->slots_capacity ? column->slots_capacity * 2 : 1024;
+        uint32_t *slots = calloc(capacity, sizeof(uint32_t));
+        if (slots == NULL) {
+            perror("Error allocating dictionary");
+            exit(1);
+        }
+        for (uint32_t id = 0; id < column->num_strings; id++) {
+            uint32_t slot = hash_string(column->pool + column->offsets[id], string_length(column, id)) & (capacity - 1);
+            while (slots[slot] != 0)
+                slot = (slot + 1) & (capacity - 1);
+            slots[slot] = id + 1;
+        }
+        free(column->slots);
+        column->slots = slots;
+        column->slots_capacity = capacity;
+    }
+
+    uint32_t *slot = find_slot(column, s, length);
+    if (*slot != 0)
+        return *slot - 1;
+
+    uint32_t id = column->num_strings;
+    uint64_t offsets_capacity = column->offsets_capacity;
+    column->offsets = grow_array(column->offsets, &offsets_capacity, (uint64_t)id + 2, sizeof(uint32_t));
+    column->offsets_capacity = offsets_capacity;
+    column->pool = grow_array(column->pool, &column->pool_capacity, column->pool_size + length + 1, 1);
+    if (id == 0)
+        column->offsets[0] = 0;
+    memcpy(column->pool + column->pool_size, s, length);
+    column->pool[column->pool_size + length] = '\0';
+    column->pool_size += length + 1;
+    column->offsets[id + 1] = column->pool_size;
+    column->num_strings++;
+    *slot = id + 1;
+    return id;
+}
+
+// Make room for one more row in every per-row array
+void grow_rows(struct column_store *store) {
+    uint64_t capacity = store->rows_capacity ? store->rows_capacity * 2 : 1024;
+    for (size_t c = 0; c < NUM_COLUMNS; c++) {
+        struct column *column = &store->columns[c];
+        uint64_t old = store->rows_capacity;
+        switch (column_defs[c].kind) {
+            case COLUMN_STRING:
+                column->ids = grow_array(column->ids, &old, capacity, sizeof(uint32_t));
+                break;
+            case COLUMN_STRING_LIST:
+                old = old ? old + 1 : 0;
+                column->list_offsets = grow_array(column->list_offsets, &old, capacity + 1, sizeof(uint32_t));
+                column->list_offsets[0] = 0;
+                break;
+            case COLUMN_U32:
+                column->u32 = grow_array(column->u32, &old, capacity, sizeof(uint32_t));
+                break;
+            case COLUMN_U64:
+                column->u64 = grow_array(column->u64, &old, capacity, sizeof(uint64_t));
+                break;
+        }
+    }
+    store->rows_capacity = capacity;
+}
+
+void add_row(struct column_store *store, const char *path, const evo_metadata *metadata) {
+    uint64_t row = store->num_rows;
+    const char *base = (const char *)metadata;
+    if (row == store->rows_capacity)
+        grow_rows(store);
+
+    for (size_t c = 0; c < NUM_COLUMNS; c++) {
+        const struct column_def *def = &column_defs[c];
+        struct column *column = &store->columns[c];
+        switch (def->kind) {
+            case COLUMN_STRING: {
+                const char *s = c == COLUMN_PATH ? path : base + def->offset;
+                size_t length = c == COLUMN_PATH ? strlen(path) : strnlen(s, def->length - 1);
+                column->ids[row] = intern_string(column, s, length);
+                break;
+            }
+            case COLUMN_STRING_LIST: {
+                uint32_t count;
+                memcpy(&count, base + def->count_offset, sizeof(count));
+                if (count > def->max_count)
+                    count = def->max_count;
+                column->list_ids = grow_array(column->list_ids, &column->list_capacity,
+                                              column->list_count + count, sizeof(uint32_t));
+                for (uint32_t i = 0; i < count; i++) {
+                    const char *s = base + def->offset + i * def->length;
+                    column->list_ids[column->list_count++] = intern_string(column, s, strnlen(s, def->length - 1));
+                }
+                column->list_offsets[row + 1] = column->list_count;
+                break;
+            }
+            case COLUMN_U32:
+                memcpy(&column->u32[row], base + def->offset, sizeof(uint32_t));
+                break;
+            case COLUMN_U64:
+                memcpy(&column->u64[row], base + def->offset, sizeof(uint64_t));
+                break;
+        }
+    }
+    store->num_rows++;
+}
+
+int load_package(struct column_store *store, const char *path) {
+    int fd = evo_open_package(path, O_RDONLY);
+    if (fd == -1) {
+        perror(path);
+        return -1;
+    }
+
+    struct evo_header header;
+    if (read(fd, &header, sizeof(header)) != sizeof(header) ||
+        memcmp(header.magic, EVO_MAGIC, sizeof(header.magic)) != 0) {
+        fprintf(stderr, "%s: Invalid EVO file format\n", path);
+        close(fd);
+        return -1;
+    }
+
+    static evo_metadata metadata;
+    if (read(fd, &metadata, sizeof(metadata)) != sizeof(metadata)) {
+        fprintf(stderr, "%s: Error reading metadata\n", path);
+        close(fd);
+        return -1;
+    }
+    close(fd);
+
+    add_row(store, path, &metadata);
+    return 0;
+}
+
+int write_section(FILE *file, const void *data, size_t length) {
+    static const char padding[8];
+    if (length > 0 && fwrite(data, 1, length, file) != length)
+        return -1;
+    size_t pad = (8 - length % 8) % 8;
+    if (pad > 0 && fwrite(padding, 1, pad, file) != pad)
+        return -1;
+    return 0;
+}
+
+int save_index(const struct column_store *store, const char *index_file) {
+    FILE *file = fopen(index_file, "wb");
+    if (file == NULL) {
+        perror("Error opening index file");
+        return -1;
+    }
+
+    struct index_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, EVO_INDEX_MAGIC, sizeof(header.magic));
+    header.version = EVO_INDEX_VERSION;
+    header.num_columns = NUM_COLUMNS;
+    header.num_rows = store->num_rows;
+    int failed = write_section(file, &header, sizeof(header));
+
+    static const uint32_t empty_offsets[1] = {0};
+    for (size_t c = 0; c < NUM_COLUMNS && !failed; c++) {
+        const struct column *column = &store->columns[c];
+        struct index_column_header column_header;
+        memset(&column_header, 0, sizeof(column_header));
+        column_header.kind = column_defs[c].kind;
+        column_header.num_strings = column->num_strings;
+        column_header.pool_size = column->pool_size;
+        column_header.list_count = column->list_count;
+        column_header.slots_capacity = column->slots_capacity;
+        failed |= write_section(file, &column_header, sizeof(column_header));
+
+        switch (column_defs[c].kind) {
+            case COLUMN_STRING:
+            case COLUMN_STRING_LIST:
+                failed |= write_section(file, column->num_strings ? column->offsets : empty_offsets,
+                                        ((size_t)column->num_strings + 1) * sizeof(uint32_t));
+                failed |= write_section(file, column->pool, column->pool_size);
+                failed |= write_section(file, column->slots, (size_t)column->slots_capacity * sizeof(uint32_t));
+                if (column_defs[c].kind == COLUMN_STRING) {
+                    failed |= write_section(file, column->ids, store->num_rows * sizeof(uint32_t));
+                } else {
+                    failed |= write_section(file, store->num_rows ? column->list_offsets : empty_offsets,
+                                            (store->num_rows + 1) * sizeof(uint32_t));
+                    failed |= write_section(file, column->list_ids, column->list_count * sizeof(uint32_t));
+                }
+                break;
+            case COLUMN_U32:
+                failed |= write_section(file, column->u32, store->num_rows * sizeof(uint32_t));
+                break;
+            case COLUMN_U64:
+                failed |= write_section(file, column->u64, store->num_rows * sizeof(uint64_t));
+                break;
+        }
+    }
+
+    if (fclose(file) != 0)
+        failed = 1;
+    if (failed) {
+        perror("Error writing index file");
+        return -1;
+    }
+    return 0;
+}
+
+// Check everything a query dereferences in a loaded column: the dictionary
+// offsets and terminators, the hash table, and every id and list offset of
+// the rows
+int valid_column(const struct column *column, enum column_kind kind, uint64_t num_rows) {
+    if (kind != COLUMN_STRING && kind != COLUMN_STRING_LIST)
+        return 1;
+    const uint32_t *offsets = column->offsets;
+    if (offsets[0] != 0 || offsets[column->num_strings] != column->pool_size)
+        return 0;
+    for (uint32_t id = 0; id < column->num_strings; id++) {
+        if (offsets[id + 1] <= offsets[id] || offsets[id + 1] > column->pool_size ||
+            column->pool[offsets[id + 1] - 1] != '\0')
+            return 0;
+    }
+
+    // Lookups probe until an empty slot, so there must be one
+    uint32_t capacity = column->slots_capacity;
+    if (capacity == 0 ? column->num_strings != 0 : (capacity & (capacity - 1)) != 0)
+        return 0;
+    uint32_t used = 0;
+    for (uint32_t slot = 0; slot < capacity; slot++) {
+        if (column->slots[slot] > column->num_strings)
+            return 0;
+        used += column->slots[slot] != 0;
+    }
+    if (capacity > 0 && used == capacity)
+        return 0;
+
+    if (kind == COLUMN_STRING) {
+        for (uint64_t row = 0; row < num_rows; row++) {
+            if (column->ids[row] >= column->num_strings)
+                return 0;
+        }
+        return 1;
+    }
+    if (column->list_offsets[0] != 0 || column->list_offsets[num_rows] != column->list_count)
+        return 0;
+    for (uint64_t row = 0; row < num_rows; row++) {
+        if (column->list_offsets[row + 1] < column->list_offsets[row])
+            return 0;
+    }
+    for (uint64_t i = 0; i < column->list_count; i++) {
+        if (column->list_ids[i] >= column->num_strings)
+            return 0;
+    }
+    return 1;
+}
+
+// Point the columns straight into a memory-mapped index
+int load_index(struct column_store *store, const char *index_file) {
+    int fd = open(index_file, O_RDONLY);
+    if (fd == -1) {
+        perror("Error opening index file");
+        return -1;
+    }
+    struct stat index_stat;
+    if (fstat(fd, &index_stat) == -1) {
+        perror("Error getting index file size");
+        close(fd);
+        return -1;
+    }
+    size_t size = index_stat.st_size;
+    char *map = size ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Error mapping index file\n");
+        return -1;
+    }
+
+    size_t position = 0;
+#define TAKE(pointer, length) do { \
+        size_t take_length = (length); \
+        if (take_length > size - position) goto invalid; \
+        (pointer) = (void *)(map + position); \
+        position += (take_length + 7) & ~(size_t)7; \
+        if (position > size) position = size; \
+    } while (0)
+
+    const struct index_header *header;
+    TAKE(header, sizeof(*header));
+    if (memcmp(header->magic, EVO_INDEX_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != EVO_INDEX_VERSION || header->num_columns != NUM_COLUMNS)
+        goto invalid;
+    // Every row takes at least four bytes, which also keeps the section
+    // sizes below from overflowing
+    if (header->num_rows > size / sizeof(uint32_t))
+        goto invalid;
+    store->num_rows = header->num_rows;
+
+    for (size_t c = 0; c < NUM_COLUMNS; c++) {
+        struct column *column = &store->columns[c];
+        const struct index_column_header *column_header;
+        TAKE(column_header, sizeof(*column_header));
+        if (column_header->kind != (uint32_t)column_defs[c].kind || column_header->reserved != 0 ||
+            column_header->pool_size > size || column_header->list_count > size / sizeof(uint32_t))
+            goto invalid;
+        column->num_strings = column_header->num_strings;
+        column->pool_size = column_header->pool_size;
+        column->list_count = column_header->list_count;
+        column->slots_capacity = column_header->slots_capacity;
+        switch (column_defs[c].kind) {
+            case COLUMN_STRING:
+            case COLUMN_STRING_LIST:
+                TAKE(column->offsets, ((size_t)column->num_strings + 1) * sizeof(uint32_t));
+                TAKE(column->pool, column->pool_size);
+                TAKE(column->slots, (size_t)column->slots_capacity * sizeof(uint32_t));
+                if (column_defs[c].kind == COLUMN_STRING) {
+                    TAKE(column->ids, store->num_rows * sizeof(uint32_t));
+                } else {
+                    TAKE(column->list_offsets, (store->num_rows + 1) * sizeof(uint32_t));
+                    TAKE(column->list_ids, column->list_count * sizeof(uint32_t));
+                }
+                break;
+            case COLUMN_U32:
+                TAKE(column->u32, store->num_rows * sizeof(uint32_t));
+                break;
+            case COLUMN_U64:
+                TAKE(column->u64, store->num_rows * sizeof(uint64_t));
+                break;
+        }
+        if (!valid_column(column, column_defs[c].kind, store->num_rows))
+            goto invalid;
+    }
+#undef TAKE
+    return 0;
+
+invalid:
+    fprintf(stderr, "Invalid index file: %s\n", index_file);
+    munmap(map, size);
+    return -1;
+}
+
+// Column scans. Each writes one bit per row into a zeroed bitmap. On x86
+// the AVX2 versions are picked at run time when the CPU supports them;
+// elsewhere the scalar versions are used.
+
+void scan_u32_scalar(const uint32_t *values, uint64_t n, uint32_t lo, uint32_t hi, uint64_t *bitmap) {
+    for (uint64_t i = 0; i < n; i++) {
+        if (values[i] >= lo && values[i] <= hi)
+            bitmap[i / 64] |= (uint64_t)1 << (i % 64);
+    }
+}
+
+void scan_u64_scalar(const uint64_t *values, uint64_t n, uint64_t lo, uint64_t hi, uint64_t *bitmap) {
+    for (uint64_t i = 0; i < n; i++) {
+        if (values[i] >= lo && values[i] <= hi)
+            bitmap[i / 64] |= (uint64_t)1 << (i % 64);
+    }
+}
+
+// Mark every dictionary string that contains needle
+void find_substring_scalar(const struct column *column, const char *needle, size_t length, uint8_t *matches) {
+    for (uint32_t id = 0; id < column->num_strings; id++) {
+        if (memmem(column->pool + column->offsets[id], string_length(column, id), needle, length) != NULL)
+            matches[id] = 1;
+    }
+}
+
+// Mark every dictionary string that starts with prefix
+void find_prefix_scalar(const struct column *column, const char *prefix, size_t length, uint8_t *matches) {
+    for (uint32_t id = 0; id < column->num_strings; id++) {
+        if (string_length(column, id) >= length && memcmp(column->pool + column->offsets[id], prefix, length) == 0)
+            matches[id] = 1;
+    }
+}
+
+#ifdef EVO_QUERY_AVX2
+__attribute__((target("avx2")))
+void scan_u32_avx2(const uint32_t *values, uint64_t n, uint32_t lo, uint32_t hi, uint64_t *bitmap) {
+    const __m256i bias = _mm256_set1_epi32((int)0x80000000u);
+    const __m256i low = _mm256_set1_epi32((int)(lo ^ 0x80000000u));
+    const __m256i high = _mm256_set1_epi32((int)(hi ^ 0x80000000u));
+    uint64_t i = 0;
+    for (; i + 64 <= n; i += 64) {
+        uint64_t bits = 0;
+        for (int k = 0; k < 8; k++) {
+            __m256i v = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(values + i + 8 * k)), bias);
+            __m256i outside = _mm256_or_si256(_mm256_cmpgt_epi32(low, v), _mm256_cmpgt_epi32(v, high));
+            bits |= (uint64_t)(~_mm256_movemask_ps(_mm256_castsi256_ps(outside)) & 0xff) << (8 * k);
+        }
+        bitmap[i / 64] = bits;
+    }
+    scan_u32_scalar(values + i, n - i, lo, hi, bitmap + i / 64);
+}
+
+__attribute__((target("avx2")))
+void scan_u64_avx2(const uint64_t *values, uint64_t n, uint64_t lo, uint64_t hi, uint64_t *bitmap) {
+    const __m256i bias = _mm256_set1_epi64x((long long)0x8000000000000000ull);
+    const __m256i low = _mm256_set1_epi64x((long long)(lo ^ 0x8000000000000000ull));
+    const __m256i high = _mm256_set1_epi64x((long long)(hi ^ 0x8000000000000000ull));
+    uint64_t i = 0;
+    for (; i + 64 <= n; i += 64) {
+        uint64_t bits = 0;
+        for (int k = 0; k < 16; k++) {
+            __m256i v = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(values + i + 4 * k)), bias);
+            __m256i outside = _mm256_or_si256(_mm256_cmpgt_epi64(low, v), _mm256_cmpgt_epi64(v, high));
+            bits |= (uint64_t)(~_mm256_movemask_pd(_mm256_castsi256_pd(outside)) & 0xf) << (4 * k);
+        }
+        bitmap[i / 64] = bits;
+    }
+    scan_u64_scalar(values + i, n - i, lo, hi, bitmap + i / 64);
+}
+
+// Scans the whole dictionary pool 32 bytes at a time, comparing the first
+// and last needle bytes at every position and confirming candidates with
+// memcmp. The needle has no NUL, so a match never spans two strings.
+__attribute__((target("avx2")))
+void find_substring_avx2(const struct column *column, const char *needle, size_t length, uint8_t *matches) {
+    const char *pool = column->pool;
+    uint64_t pool_size = column->pool_size;
+    const __m256i first = _mm256_set1_epi8(needle[0]);
+    const __m256i last = _mm256_set1_epi8(needle[length - 1]);
+    uint32_t id = 0;
+    uint64_t i = 0;
+
+    for (; i + length - 1 + 32 <= pool_size; i += 32) {
+        __m256i block_first = _mm256_loadu_si256((const __m256i *)(pool + i));
+        __m256i block_last = _mm256_loadu_si256((const __m256i *)(pool + i + length - 1));
+        uint32_t mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(first, block_first),
+                                                              _mm256_cmpeq_epi8(last, block_last)));
+        while (mask != 0) {
+            uint64_t position = i + __builtin_ctz(mask);
+            mask &= mask - 1;
+            if (length > 2 && memcmp(pool + position + 1, needle + 1, length - 2) != 0)
+                continue;
+            while (column->offsets[id + 1] <= position)
+                id++;
+            matches[id] = 1;
+        }
+    }
+    for (; i + length <= pool_size; i++) {
+        if (memcmp(pool + i, needle, length) == 0) {
+            while (column->offsets[id + 1] <= i)
+                id++;
+            matches[id] = 1;
+        }
+    }
+}
+
+// Compares the first 32 bytes of every string with the prefix in one
+// instruction, under a mask of the prefix length; longer prefixes finish
+// with memcmp. Strings too close to the end of the pool for a full load
+// fall back to memcmp.
+__attribute__((target("avx2")))
+void find_prefix_avx2(const struct column *column, const char *prefix, size_t length, uint8_t *matches) {
+    size_t head = length < 32 ? length : 32;
+    char padded[32] = {0};
+    memcpy(padded, prefix, head);
+    const __m256i wanted = _mm256_loadu_si256((const __m256i *)padded);
+    const uint32_t need = head == 32 ? UINT32_MAX : ((uint32_t)1 << head) - 1;
+    for (uint32_t id = 0; id < column->num_strings; id++) {
+        const char *s = column->pool + column->offsets[id];
+        if (string_length(column, id) < length)
+            continue;
+        if (column->offsets[id] + 32 > column->pool_size) {
+            matches[id] = memcmp(s, prefix, length) == 0;
+            continue;
+        }
+        uint32_t mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)s), wanted));
+        if ((mask & need) == need && (length <= 32 || memcmp(s + 32, prefix + 32, length - 32) == 0))
+            matches[id] = 1;
+    }
+}
+#endif
+
+// The scan implementations in use, picked once on first use
+struct scans {
+    void (*u32)(const uint32_t *values, uint64_t n, uint32_t lo, uint32_t hi, uint64_t *bitmap);
+    void (*u64)(const uint64_t *values, uint64_t n, uint64_t lo, uint64_t hi, uint64_t *bitmap);
+    void (*substring)(const struct column *column, const char *needle, size_t length, uint8_t *matches);
+    void (*prefix)(const struct column *column, const char *prefix, size_t length, uint8_t *matches);
+};
+
+const struct scans *pick_scans(void) {
+    static struct scans scans = {scan_u32_scalar, scan_u64_scalar, find_substring_scalar, find_prefix_scalar};
+    static int picked;
+    if (!picked) {
+#ifdef EVO_QUERY_AVX2
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            scans.u32 = scan_u32_avx2;
+            scans.u64 = scan_u64_avx2;
+            scans.substring = find_substring_avx2;
+            scans.prefix = find_prefix_avx2;
+        }
+#endif
+        picked = 1;
+    }
+    return &scans;
+}
+
+// Returns the id of the exact string, or UINT32_MAX if it is not interned
+uint32_t find_string(const struct column *column, const char *s, size_t length) {
+    if (column->slots_capacity == 0)
+        return UINT32_MAX;
+    uint32_t slot = *find_slot(column, s, length);
+    return slot != 0 ? slot - 1 : UINT32_MAX;
+}
+
+enum term_op { OP_EQ, OP_NE, OP_SUBSTRING, OP_PREFIX, OP_LT, OP_LE, OP_GT, OP_GE };
+
+struct term {
+    size_t column;
+    enum term_op op;
+    char *value;
+    int starts_group;     // First term after an 'or'
+};
+
+int parse_term(char *text, struct term *term) {
+    static const struct { const char *symbol; enum term_op op; } ops[] = {
+        {"!=", OP_NE}, {"^=", OP_PREFIX}, {"<=", OP_LE}, {">=", OP_GE},
+        {"=", OP_EQ}, {"~", OP_SUBSTRING}, {"<", OP_LT}, {">", OP_GT},
+    };
+    while (*text == ' ')
+        text++;
+    size_t name_length = strspn(text, "abcdefghijklmnopqrstuvwxyz_");
+    char *rest = text + name_length;
+    while (*rest == ' ')
+        rest++;
+
+    term->column = NUM_COLUMNS;
+    for (size_t c = 0; c < NUM_COLUMNS; c++) {
+        if (strlen(column_defs[c].name) == name_length && strncmp(column_defs[c].name, text, name_length) == 0)
+            term->column = c;
+    }
+    if (term->column == NUM_COLUMNS) {
+        fprintf(stderr, "Unknown field in: %s\n", text);
+        return -1;
+    }
+
+    size_t i;
+    for (i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+        if (strncmp(rest, ops[i].symbol, strlen(ops[i].symbol)) == 0)
+            break;
+    }
+    if (i == sizeof(ops) / sizeof(ops[0])) {
+        fprintf(stderr, "Missing operator in: %s\n", text);
+        return -1;
+    }
+    term->op = ops[i].op;
+    term->value = rest + strlen(ops[i].symbol);
+    while (*term->value == ' ')
+        term->value++;
+    size_t value_length = strlen(term->value);
+    while (value_length > 0 && term->value[value_length - 1] == ' ')
+        term->value[--value_length] = '\0';
+
+    enum column_kind kind = column_defs[term->column].kind;
+    int numeric = kind == COLUMN_U32 || kind == COLUMN_U64;
+    if (numeric && (term->op == OP_SUBSTRING || term->op == OP_PREFIX)) {
+        fprintf(stderr, "%s is numeric and cannot be matched as text\n", column_defs[term->column].name);
+        return -1;
+    }
+    if (!numeric && term->op >= OP_LT) {
+        fprintf(stderr, "%s is text and cannot be compared by range\n", column_defs[term->column].name);
+        return -1;
+    }
+    if (!numeric && term->op == OP_SUBSTRING && value_length == 0) {
+        fprintf(stderr, "Empty substring in: %s\n", text);
+        return -1;
+    }
+    if (numeric) {
+        char *end;
+        strtoull(term->value, &end, 10);
+        if (end == term->value || *end != '\0') {
+            fprintf(stderr, "Invalid number in: %s\n", text);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Split on ' or ' and ' and ' into a list of terms
+int parse_expression(char *expression, struct term **terms, size_t *num_terms) {
+    size_t capacity = 8;
+    *terms = malloc(capacity * sizeof(struct term));
+    *num_terms = 0;
+    if (*terms == NULL)
+        return -1;
+
+    int starts_group = 1;
+    char *cursor = expression;
+    while (cursor != NULL) {
+        char *next_or = strstr(cursor, " or ");
+        char *next_and = strstr(cursor, " and ");
+        char *end = next_or;
+        int next_starts_group = 1;
+        if (next_and != NULL && (end == NULL || next_and < end)) {
+            end = next_and;
+            next_starts_group = 0;
+        }
+        char *next = NULL;
+        if (end != NULL) {
+            *end = '\0';
+            next = end + (next_starts_group ? 4 : 5);
+        }
+
+        if (*num_terms == capacity) {
+            capacity *= 2;
+            struct term *grown = realloc(*terms, capacity * sizeof(struct term));
+            if (grown == NULL)
+                return -1;
+            *terms = grown;
+        }
+        struct term *term = &(*terms)[*num_terms];
+        if (parse_term(cursor, term) == -1)
+            return -1;
+        term->starts_group = starts_group;
+        (*num_terms)++;
+
+        starts_group = next_starts_group;
+        cursor = next;
+    }
+    return 0;
+}
+
+void evaluate_term(const struct column_store *store, const struct term *term, uint64_t *bitmap, uint64_t words) {
+    const struct scans *scans = pick_scans();
+    const struct column *column = &store->columns[term->column];
+    enum column_kind kind = column_defs[term->column].kind;
+    memset(bitmap, 0, words * sizeof(uint64_t));
+
+    if (kind == COLUMN_U32 || kind == COLUMN_U64) {
+        uint64_t value = strtoull(term->value, NULL, 10);
+        uint64_t max = kind == COLUMN_U32 ? UINT32_MAX : UINT64_MAX;
+        uint64_t lo = 0, hi = max;
+        int negate = 0;
+        if (value > max) {
+            // Out of range for the column: only the open-ended comparisons match
+            if (term->op == OP_EQ || term->op == OP_GT || term->op == OP_GE)
+                return;
+        } else {
+            switch (term->op) {
+                case OP_EQ: lo = hi = value; break;
+                case OP_NE: lo = hi = value; negate = 1; break;
+                case OP_LT: if (value == 0) return; hi = value - 1; break;
+                case OP_LE: hi = value; break;
+                case OP_GT: if (value == max) return; lo = value + 1; break;
+                case OP_GE: lo = value; break;
+                default: return;
+            }
+        }
+        if (kind == COLUMN_U32) {
+            scans->u32(column->u32, store->num_rows, lo, hi, bitmap);
+        } else {
+            scans->u64(column->u64, store->num_rows, lo, hi, bitmap);
+        }
+        if (negate) {
+            for (uint64_t w = 0; w < words; w++)
+                bitmap[w] = ~bitmap[w];
+        }
+        return;
+    }
+
+    size_t value_length = strlen(term->value);
+    if (kind == COLUMN_STRING && (term->op == OP_EQ || term->op == OP_NE)) {
+        // Exact matches become an integer scan over the id column
+        uint32_t id = find_string(column, term->value, value_length);
+        if (id != UINT32_MAX)
+            scans->u32(column->ids, store->num_rows, id, id, bitmap);
+        if (term->op == OP_NE) {
+            for (uint64_t w = 0; w < words; w++)
+                bitmap[w] = ~bitmap[w];
+        }
+        return;
+    }
+
+    // Everything else resolves to a set of dictionary ids first, so each
+    // distinct string is examined once however many packages share it
+    uint8_t *matches = calloc(column->num_strings + 1, 1);
+    if (matches == NULL) {
+        perror("Error allocating match set");
+        exit(1);
+    }
+    if (term->op == OP_SUBSTRING) {
+        scans->substring(column, term->value, value_length, matches);
+    } else if (term->op == OP_PREFIX) {
+        scans->prefix(column, term->value, value_length, matches);
+    } else {
+        uint32_t id = find_string(column, term->value, value_length);
+        if (id != UINT32_MAX)
+            matches[id] = 1;
+    }
+
+    if (kind == COLUMN_STRING) {
+        for (uint64_t row = 0; row < store->num_rows; row++) {
+            if (matches[column->ids[row]])
+                bitmap[row / 64] |= (uint64_t)1 << (row % 64);
+        }
+    } else {
+        for (uint64_t row = 0; row < store->num_rows; row++) {
+            for (uint32_t i = column->list_offsets[row]; i < column->list_offsets[row + 1]; i++) {
+                if (matches[column->list_ids[i]]) {
+                    bitmap[row / 64] |= (uint64_t)1 << (row % 64);
+                    break;
+                }
+            }
+        }
+        if (term->op == OP_NE) {
+            for (uint64_t w = 0; w < words; w++)
+                bitmap[w] = ~bitmap[w];
+        }
+    }
+    free(matches);
+}
+
+// Evaluate the terms as an OR of AND groups
+uint64_t *evaluate(const struct column_store *store, const struct term *terms, size_t num_terms, uint64_t words) {
+    uint64_t *result = calloc(words ? words : 1, sizeof(uint64_t));
+    uint64_t *group = malloc((words ? words : 1) * sizeof(uint64_t));
+    uint64_t *scratch = malloc((words ? words : 1) * sizeof(uint64_t));
+    if (result == NULL || group == NULL || scratch == NULL) {
+        perror("Error allocating bitmaps");
+        exit(1);
+    }
+
+    for (size_t t = 0; t < num_terms; t++) {
+        if (terms[t].starts_group) {
+            evaluate_term(store, &terms[t], group, words);
+        } else {
+            evaluate_term(store, &terms[t], scratch, words);
+            for (uint64_t w = 0; w < words; w++)
+                group[w] &= scratch[w];
+        }
+        if (t + 1 == num_terms || terms[t + 1].starts_group) {
+            for (uint64_t w = 0; w < words; w++)
+                result[w] |= group[w];
+        }
+    }
+
+    // Clear the bits past the last row that negation may have set
+    if (store->num_rows % 64)
+        result[words - 1] &= ((uint64_t)1 << (store->num_rows % 64)) - 1;
+    free(group);
+    free(scratch);
+    return result;
+}
+
+const char *row_string(const struct column_store *store, size_t c, uint64_t row) {
+    const struct column *column = &store->columns[c];
+    return column->pool + column->offsets[column->ids[row]];
+}
+
+double elapsed_ms(const struct timespec *start, const struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) * 1e3 + (end->tv_nsec - start->tv_nsec) / 1e6;
+}
+
+int main(int argc, char *argv[]) {
+    char *index_file = NULL;
+    char *build_index_file = NULL;
+    char *expression = NULL;
+    int count_only = 0;
+
+    static const struct option long_options[] = {
+        {"index", required_argument, NULL, 'x'},
+        {"build-index", required_argument, NULL, 'b'},
+        {"where", required_argument, NULL, 'w'},
+        {"count", no_argument, NULL, 'c'},
+        {NULL, 0, NULL, 0}
+    };
+
+    // Parse command-line arguments
+    int opt;
+    while ((opt = getopt_long(argc, argv, "x:b:w:c", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'x':
+                index_file = optarg;
+                break;
+            case 'b':
+                build_index_file = optarg;
+                break;
+            case 'w':
+                expression = optarg;
+                break;
+            case 'c':
+                count_only = 1;
+                break;
+            default:
+                print_usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if ((index_file == NULL) == (optind == argc) || (expression == NULL && build_index_file == NULL)) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    static struct column_store store;
+    struct timespec start, loaded, done;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (index_file != NULL) {
+        if (load_index(&store, index_file) == -1)
+            return 1;
+    } else {
+        for (int i = optind; i < argc; i++) {
+            if (load_package(&store, argv[i]) == -1)
+                return 1;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &loaded);
+    fprintf(stderr, "Loaded %lu packages in %.2f ms\n", store.num_rows, elapsed_ms(&start, &loaded));
+
+    if (build_index_file != NULL) {
+        if (save_index(&store, build_index_file) == -1)
+            return 1;
+        fprintf(stderr, "Wrote index %s\n", build_index_file);
+    }
+    if (expression == NULL)
+        return 0;
+
+    struct term *terms;
+    size_t num_terms;
+    if (parse_expression(expression, &terms, &num_terms) == -1)
+        return 1;
+
+    uint64_t words = (store.num_rows + 63) / 64;
+    uint64_t *result = evaluate(&store, terms, num_terms, words);
+    clock_gettime(CLOCK_MONOTONIC, &done);
+
+    uint64_t matched = 0;
+    for (uint64_t w = 0; w < words; w++)
+        matched += __builtin_popcountll(result[w]);
+
+    if (count_only) {
+        printf("%lu\n", matched);
+    } else {
+        for (uint64_t row = 0; row < store.num_rows; row++) {
+            if (result[row / 64] & ((uint64_t)1 << (row % 64))) {
+                printf("%s\t%s\t%s\n", row_string(&store, COLUMN_PATH, row),
+                       row_string(&store, COLUMN_NAME, row), row_string(&store, COLUMN_VERSION, row));
+            }
+        }
+    }
+    fprintf(stderr, "Matched %lu of %lu packages in %.2f ms\n", matched, store.num_rows, elapsed_ms(&loaded, &done));
+
+    free(result);
+    free(terms);
+    return 0;
+}
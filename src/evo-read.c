@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -6,12 +7,15 @@
 #include <stdint.h>
 #include "evo_format.h"
 #include "evo_metadata.h"
+#include "evo_slice.h"
+#include "evo_tree.h"
+#include "evo_output.h"
 
 #define BUFFER_SIZE 4096
 #define MIN(a,b) ((a) < (b) ? (a) : (b))
 
 void print_usage(const char *program_name) {
-    fprintf(stderr, "Usage: %s --input <input_file.evo>\n", program_name);
+    fprintf(stderr, "Usage: %s --input <input_file.evo> [--arch <architecture>]\n", program_name);
 }
 
 uint32_t crc32(const void *data, size_t length) {
@@ -48,8 +52,68 @@ void display_metadata(const evo_metadata *metadata) {
     printf("Package type: %u\n", metadata->package_type);
 }
 
+void display_extent_table(const struct evo_extent_table *table) {
+    printf("\nSparse Image:\n");
+    printf("Image size: %lu bytes\n", table->image_size);
+    printf("Extents: %u\n", table->num_extents);
+}
+
+void display_slices(const struct evo_header *header, const struct evo_slice *slices, uint32_t num_slices) {
+    printf("\nSlices (%u):\n", num_slices);
+    for (uint32_t i = 0; i < num_slices; i++) {
+        printf("  %-16s offset %lu, %lu bytes, checksum 0x%08X\n", slices[i].architecture,
+               evo_data_offset(header) + slices[i].offset, slices[i].size, slices[i].checksum);
+    }
+}
+
+void display_file_tree(const struct evo_file_tree *tree) {
+    printf("\nFiles (%u):\n", tree->table.num_files);
+    for (uint32_t i = 0; i < tree->table.num_files; i++) {
+        const struct evo_file_entry *entry = &tree->entries[i];
+        printf("  %06o %10lu  ", entry->mode, entry->size);
+        for (int j = 0; j < 8; j++)
+            printf("%02x", entry->digest[j]);
+        printf("  %s\n", evo_file_path(tree, i));
+    }
+}
+
+// Verify only the slices a device of the given architecture needs, instead
+// of the whole package.
+int verify_architecture(int fd, const struct evo_header *header, const struct evo_slice *slices,
+                        uint32_t num_slices, const char *architecture) {
+    const struct evo_slice *wanted[2];
+    int count = 0;
+    const struct evo_slice *shared = evo_find_slice(slices, num_slices, EVO_SLICE_SHARED);
+    const struct evo_slice *own = evo_find_slice(slices, num_slices, architecture);
+    if (own == NULL) {
+        fprintf(stderr, "No slice for architecture %s\n", architecture);
+        return 1;
+    }
+    if (shared != NULL && shared != own)
+        wanted[count++] = shared;
+    wanted[count++] = own;
+
+    printf("\nData Integrity (%s):\n", architecture);
+    int passed = 1;
+    for (int i = 0; i < count; i++) {
+        int result = evo_verify_slice(fd, header, wanted[i]);
+        if (result == -1) {
+            perror("Error reading slice");
+            return 1;
+        }
+        printf("Slice %s: bytes %lu-%lu, checksum verification: %s\n", wanted[i]->architecture,
+               evo_data_offset(header) + wanted[i]->offset,
+               evo_data_offset(header) + wanted[i]->offset + wanted[i]->size,
+               result ? "PASSED" : "FAILED");
+        passed = passed && result;
+    }
+    printf("Checksum verification: %s\n", passed ? "PASSED" : "FAILED");
+    return 0;
+}
+
 int main(int argc, char *argv[]) {
     char *input_file = NULL;
+    char *architecture = NULL;
 
     // Parse command-line arguments
     for (int i = 1; i < argc; i += 2) {
@@ -59,6 +123,8 @@ int main(int argc, char *argv[]) {
         }
         if (strcmp(argv[i], "--input") == 0) {
             input_file = argv[i + 1];
+        } else if (strcmp(argv[i], "--arch") == 0) {
+            architecture = argv[i + 1];
         } else {
             print_usage(argv[0]);
             return 1;
@@ -71,7 +137,7 @@ int main(int argc, char *argv[]) {
     }
 
     // Open input file
-    int fd = open(input_file, O_RDONLY);
+    int fd = evo_open_package(input_file, O_RDONLY);
     if (fd == -1) {
         perror("Error opening input file");
         return 1;
@@ -114,6 +180,59 @@ int main(int argc, char *argv[]) {
 
     display_metadata(&metadata);
 
+    // Sparse packages keep their extent table at the end of the data section
+    if (header.version == EVO_VERSION_SPARSE) {
+        struct evo_extent_table table;
+        off_t table_offset = sizeof(header) + header.metadata_size + header.data_size - sizeof(table);
+        if (pread(fd, &table, sizeof(table), table_offset) != sizeof(table)) {
+            perror("Error reading extent table");
+            close(fd);
+            close(checksum_fd);
+            return 1;
+        }
+        if (table.reserved != 0) {
+            fprintf(stderr, "Invalid extent table\n");
+            close(fd);
+            close(checksum_fd);
+            return 1;
+        }
+        display_extent_table(&table);
+    }
+
+    // Sliced packages list their slices, and can be checked per architecture
+    if (header.version == EVO_VERSION_SLICED) {
+        struct evo_slice_table table;
+        struct evo_slice *slices;
+        if (evo_load_slices(fd, &header, &table, &slices) == -1) {
+            fprintf(stderr, "Error reading slice table\n");
+            close(fd);
+            close(checksum_fd);
+            return 1;
+        }
+        display_slices(&header, slices, table.num_slices);
+        if (architecture != NULL) {
+            int result = verify_architecture(fd, &header, slices, table.num_slices, architecture);
+            free(slices);
+            close(fd);
+            close(checksum_fd);
+            return result;
+        }
+        free(slices);
+    } else if (header.version == EVO_VERSION_TREE) {
+        struct evo_file_tree tree;
+        if (evo_load_file_tree(fd, &header, &tree) == -1) {
+            fprintf(stderr, "Error reading file table\n");
+            close(fd);
+            close(checksum_fd);
+            return 1;
+        }
+        display_file_tree(&tree);
+        evo_free_file_tree(&tree);
+    }
+    if (header.version != EVO_VERSION_SLICED && architecture != NULL) {
+        fprintf(stderr, "Package has no per-architecture slices; verifying the whole file\n");
+    }
+
     // Verify data integrity
     uint32_t calculated_checksum = 0xffffffff;
     char buffer[BUFFER_SIZE];
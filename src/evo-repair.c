@@ -0,0 +1,333 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "evo_format.h"
+#include "evo_checksum.h"
+#include "evo_chunks.h"
+#include "evo_output.h"
+
+#define BUFFER_SIZE (1024 * 1024)
+#define MIN(a,b) ((a) < (b) ? (a) : (b))
+
+void print_usage(const char *program_name) {
+    fprintf(stderr, "Usage: %s --input <damaged_file.evo> --reference <reference_file.evo>\n", program_name);
+    fprintf(stderr, "       %s --index <package.evo>\n", program_name);
+    fprintf(stderr, "Chunks of the input whose checksum differs from the reference are rewritten in place.\n");
+    fprintf(stderr, "--index writes <package.evo>.evo-chunks so the package can serve as a reference\n");
+    fprintf(stderr, "without being read in full.\n");
+}
+
+uint32_t crc32(const void *data, size_t length) {
+    uint32_t crc = 0xffffffff;
+    const uint8_t *p = (const uint8_t *)data;
+    while (length--) {
+        crc ^= *p++;
+        for (int i = 0; i < 8; i++)
+            crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+    }
+    return ~crc;
+}
+
+// The reference copy is asked for its chunk index and for the bytes of the
+// ranges that need repair, which is all a mirror serving byte ranges would
+// have to send; here a local file stands in for it. A reference without a
+// valid index (see --index and evo-create --chunk-index) has to be read in
+// full to checksum its chunks.
+struct chunk_scan {
+    int fd;
+    off_t size;
+    uint32_t *crcs;
+    int failed;
+};
+
+void *scan_chunks(void *arg) {
+    struct chunk_scan *scan = arg;
+    static __thread uint8_t buffer[BUFFER_SIZE];
+    size_t chunk = 0;
+    for (off_t offset = 0; offset < scan->size;) {
+        ssize_t bytes_read = pread(scan->fd, buffer, MIN(BUFFER_SIZE, scan->size - offset), offset);
+        if (bytes_read <= 0) {
+            scan->failed = 1;
+            return NULL;
+        }
+        for (ssize_t i = 0; i < bytes_read; i += EVO_CHECKSUM_CHUNK)
+            scan->crcs[chunk++] = crc32(buffer + i, MIN(EVO_CHECKSUM_CHUNK, bytes_read - i));
+        offset += bytes_read;
+    }
+    return NULL;
+}
+
+// Copy a range from the reference over the damaged package
+int repair_range(int input_fd, int reference_fd, off_t offset, off_t length) {
+    static uint8_t buffer[BUFFER_SIZE];
+    while (length > 0) {
+        ssize_t bytes_read = pread(reference_fd, buffer, MIN(BUFFER_SIZE, length), offset);
+        if (bytes_read <= 0 || pwrite(input_fd, buffer, bytes_read, offset) != bytes_read)
+            return -1;
+        offset += bytes_read;
+        length -= bytes_read;
+    }
+    return 0;
+}
+
+
+// Write the chunk index of a package that verifies
+int index_package(const char *package_file) {
+    int fd = evo_open_package(package_file, O_RDONLY);
+    if (fd == -1) {
+        perror("Error opening package");
+        return 1;
+    }
+    struct stat package_stat;
+    if (fstat(fd, &package_stat) == -1) {
+        perror("Error getting file size");
+        close(fd);
+        return 1;
+    }
+    if (package_stat.st_size < (off_t)(sizeof(struct evo_header) + sizeof(struct evo_footer))) {
+        fprintf(stderr, "Invalid EVO file format\n");
+        close(fd);
+        return 1;
+    }
+
+    off_t content_size = package_stat.st_size - sizeof(struct evo_footer);
+    uint64_t num_chunks = evo_chunk_count(package_stat.st_size);
+    struct chunk_scan scan = {fd, content_size, malloc(num_chunks * sizeof(uint32_t) + 1), 0};
+    if (scan.crcs == NULL) {
+        perror("Error allocating chunk checksums");
+        close(fd);
+        return 1;
+    }
+    scan_chunks(&scan);
+    struct evo_footer footer;
+    int failed = scan.failed || pread(fd, &footer, sizeof(footer), content_size) != sizeof(footer);
+    close(fd);
+    if (failed) {
+        fprintf(stderr, "Error reading package\n");
+    } else if (evo_combine_crcs(scan.crcs, num_chunks) != footer.checksum) {
+        fprintf(stderr, "%s fails checksum verification\n", package_file);
+        failed = 1;
+    } else if (evo_chunks_save(package_file, package_stat.st_size, scan.crcs) == -1) {
+        perror("Error writing chunk index");
+        failed = 1;
+    } else {
+        printf("Indexed %lu chunks of %s\n", num_chunks, package_file);
+    }
+    free(scan.crcs);
+    return failed ? 1 : 0;
+}
+
+int main(int argc, char *argv[]) {
+    char *input_file = NULL;
+    char *reference_file = NULL;
+    char *index_file = NULL;
+
+    // Parse command-line arguments
+    for (int i = 1; i < argc; i += 2) {
+        if (i + 1 >= argc) {
+            print_usage(argv[0]);
+            return 1;
+        }
+        if (strcmp(argv[i], "--input") == 0) {
+            input_file = argv[i + 1];
+        } else if (strcmp(argv[i], "--reference") == 0) {
+            reference_file = argv[i + 1];
+        } else if (strcmp(argv[i], "--index") == 0) {
+            index_file = argv[i + 1];
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (index_file != NULL && input_file == NULL && reference_file == NULL)
+        return index_package(index_file);
+    if (index_file != NULL || input_file == NULL || reference_file == NULL) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    int input_fd = evo_open_package(input_file, O_RDWR);
+    if (input_fd == -1) {
+        perror("Error opening input file");
+        return 1;
+    }
+    int reference_fd = evo_open_package(reference_file, O_RDONLY);
+    if (reference_fd == -1) {
+        perror("Error opening reference file");
+        close(input_fd);
+        return 1;
+    }
+
+    struct stat input_stat, reference_stat;
+    if (fstat(input_fd, &input_stat) == -1 || fstat(reference_fd, &reference_stat) == -1) {
+        perror("Error getting file size");
+        close(input_fd);
+        close(reference_fd);
+        return 1;
+    }
+    if (reference_stat.st_size < (off_t)(sizeof(struct evo_header) + sizeof(struct evo_footer))) {
+        fprintf(stderr, "Invalid EVO file format\n");
+        close(input_fd);
+        close(reference_fd);
+        return 1;
+    }
+    if (input_stat.st_size != reference_stat.st_size) {
+        fprintf(stderr, "Input is %ld bytes but the reference is %ld bytes; chunk repair needs the same package\n",
+                (long)input_stat.st_size, (long)reference_stat.st_size);
+        close(input_fd);
+        close(reference_fd);
+        return 1;
+    }
+
+    // Everything before the footer is covered by the package checksum
+    off_t content_size = reference_stat.st_size - sizeof(struct evo_footer);
+    size_t num_chunks = evo_chunk_count(reference_stat.st_size);
+    struct evo_footer input_footer, reference_footer;
+    if (pread(reference_fd, &reference_footer, sizeof(reference_footer), content_size) != sizeof(reference_footer)) {
+        fprintf(stderr, "Error reading packages\n");
+        close(input_fd);
+        close(reference_fd);
+        return 1;
+    }
+    uint64_t reference_bytes = sizeof(reference_footer);
+
+    // The reference's chunk crcs come from its index when it has a valid
+    // one; the index only loads if they combine to the reference footer
+    struct chunk_scan input_scan = {input_fd, content_size, malloc(num_chunks * sizeof(uint32_t) + 1), 0};
+    struct chunk_scan reference_scan = {reference_fd, content_size, NULL, 0};
+    int indexed = evo_chunks_load(reference_file, reference_stat.st_size, reference_footer.checksum,
+                                  &reference_scan.crcs) == 0;
+    if (indexed) {
+        reference_bytes += sizeof(struct evo_chunk_index) + num_chunks * sizeof(uint32_t);
+    } else {
+        printf("No valid chunk index for %s; reading it in full\n", reference_file);
+        reference_scan.crcs = malloc(num_chunks * sizeof(uint32_t) + 1);
+    }
+    if (input_scan.crcs == NULL || reference_scan.crcs == NULL) {
+        perror("Error allocating chunk checksums");
+        free(input_scan.crcs);
+        free(reference_scan.crcs);
+        close(input_fd);
+        close(reference_fd);
+        return 1;
+    }
+
+    // Checksum both copies chunk by chunk, one thread each, or only the
+    // input when the reference is indexed
+    pthread_t reference_thread;
+    int threaded = !indexed && pthread_create(&reference_thread, NULL, scan_chunks, &reference_scan) == 0;
+    if (!indexed && !threaded)
+        scan_chunks(&reference_scan);
+    scan_chunks(&input_scan);
+    if (threaded)
+        pthread_join(reference_thread, NULL);
+    if (!indexed)
+        reference_bytes += content_size;
+
+    int failed = input_scan.failed || reference_scan.failed ||
+        pread(input_fd, &input_footer, sizeof(input_footer), content_size) != sizeof(input_footer);
+    if (failed) {
+        fprintf(stderr, "Error reading packages\n");
+        goto done;
+    }
+
+    // Never repair from a reference that is itself damaged
+    if (!indexed && evo_combine_crcs(reference_scan.crcs, num_chunks) != reference_footer.checksum) {
+        fprintf(stderr, "Reference %s fails checksum verification\n", reference_file);
+        failed = 1;
+        goto done;
+    }
+
+    // Merge mismatching chunks into ranges and rewrite each one
+    uint64_t bad_chunks = 0;
+    uint64_t bytes_repaired = 0;
+    for (size_t i = 0; i < num_chunks;) {
+        if (input_scan.crcs[i] == reference_scan.crcs[i]) {
+            i++;
+            continue;
+        }
+        size_t first = i;
+        while (i < num_chunks && input_scan.crcs[i] != reference_scan.crcs[i])
+            i++;
+        off_t offset = (off_t)first * EVO_CHECKSUM_CHUNK;
+        off_t length = MIN((off_t)i * EVO_CHECKSUM_CHUNK, content_size) - offset;
+        printf("Corrupt range: bytes %ld-%ld (%zu chunks)\n", (long)offset, (long)(offset + length), i - first);
+        if (repair_range(input_fd, reference_fd, offset, length) == -1) {
+            perror("Error repairing range");
+            failed = 1;
+            goto done;
+        }
+        bad_chunks += i - first;
+        bytes_repaired += length;
+    }
+    if (indexed)
+        reference_bytes += bytes_repaired;
+    if (input_footer.checksum != reference_footer.checksum) {
+        printf("Corrupt footer: stored 0x%08x, expected 0x%08x\n", input_footer.checksum, reference_footer.checksum);
+        if (pwrite(input_fd, &reference_footer, sizeof(reference_footer), content_size) != sizeof(reference_footer)) {
+            perror("Error repairing footer");
+            failed = 1;
+            goto done;
+        }
+        bytes_repaired += sizeof(reference_footer);
+    }
+    printf("Read %lu of %ld bytes from the reference\n", reference_bytes, (long)reference_stat.st_size);
+
+    if (bytes_repaired == 0) {
+        printf("No corrupt chunks found in %s\n", input_file);
+        goto done;
+    }
+    if (fdatasync(input_fd) == -1) {
+        perror("Error flushing input file");
+        failed = 1;
+        goto done;
+    }
+
+    // Re-verify only the chunks that were rewritten, each against the
+    // reference's crc, which also catches reference data that does not
+    // match its index. Every other chunk already matched, so the package
+    // checksum follows from the list.
+    static uint8_t chunk[EVO_CHECKSUM_CHUNK];
+    for (size_t i = 0; i < num_chunks; i++) {
+        if (input_scan.crcs[i] == reference_scan.crcs[i])
+            continue;
+        size_t length = MIN(EVO_CHECKSUM_CHUNK, content_size - (off_t)i * EVO_CHECKSUM_CHUNK);
+        if (pread(input_fd, chunk, length, (off_t)i * EVO_CHECKSUM_CHUNK) != (ssize_t)length) {
+            perror("Error verifying repair");
+            failed = 1;
+            goto done;
+        }
+        input_scan.crcs[i] = crc32(chunk, length);
+        if (input_scan.crcs[i] != reference_scan.crcs[i]) {
+            fprintf(stderr, "Chunk %zu still differs from the reference after repair\n", i);
+            failed = 1;
+        }
+    }
+    if (pread(input_fd, &input_footer, sizeof(input_footer), content_size) != sizeof(input_footer)) {
+        perror("Error verifying repair");
+        failed = 1;
+        goto done;
+    }
+    uint32_t calculated = evo_combine_crcs(input_scan.crcs, num_chunks);
+    failed = failed || calculated != input_footer.checksum;
+
+    printf("Repaired %lu chunks (%lu bytes)\n", bad_chunks, bytes_repaired);
+    printf("Stored checksum: 0x%08x\n", input_footer.checksum);
+    printf("Calculated checksum: 0x%08x\n", calculated);
+    printf("Checksum verification: %s\n", failed ? "FAILED" : "PASSED");
+
+done:
+    free(input_scan.crcs);
+    free(reference_scan.crcs);
+    close(input_fd);
+    close(reference_fd);
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,88 @@
+#ifndef EVO_CHECKSUM_H
+#define EVO_CHECKSUM_H
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+// Checksums are the XOR of crc32() over consecutive 4096-byte chunks,
+// seeded with 0xffffffff and inverted at the end (see evo-read).
+#define EVO_CHECKSUM_CHUNK 4096
+
+uint32_t crc32(const void *data, size_t length);
+
+struct evo_checksum {
+    uint32_t value;
+    size_t fill;
+    uint32_t *crcs;       // When set, receives the crc of every chunk
+    uint64_t num_crcs;
+    uint8_t chunk[EVO_CHECKSUM_CHUNK];
+};
+
+static inline void evo_checksum_init(struct evo_checksum *ctx) {
+    ctx->value = 0xffffffff;
+    ctx->fill = 0;
+    ctx->crcs = NULL;
+    ctx->num_crcs = 0;
+}
+
+// Keep the crc of each chunk in crcs, which must have room for every chunk
+// of the input (see evo_chunk_count())
+static inline void evo_checksum_record(struct evo_checksum *ctx, uint32_t *crcs) {
+    ctx->crcs = crcs;
+}
+
+static inline void evo_checksum_chunk(struct evo_checksum *ctx, uint32_t crc) {
+    ctx->value ^= crc;
+    if (ctx->crcs != NULL)
+        ctx->crcs[ctx->num_crcs++] = crc;
+}
+
+static inline void evo_checksum_update(struct evo_checksum *ctx, const void *data, size_t length) {
+    const uint8_t *p = (const uint8_t *)data;
+    while (length > 0) {
+        if (ctx->fill == 0 && length >= EVO_CHECKSUM_CHUNK) {
+            evo_checksum_chunk(ctx, crc32(p, EVO_CHECKSUM_CHUNK));
+            p += EVO_CHECKSUM_CHUNK;
+            length -= EVO_CHECKSUM_CHUNK;
+            continue;
+        }
+        size_t n = EVO_CHECKSUM_CHUNK - ctx->fill;
+        if (n > length)
+            n = length;
+        memcpy(ctx->chunk + ctx->fill, p, n);
+        ctx->fill += n;
+        p += n;
+        length -= n;
+        if (ctx->fill == EVO_CHECKSUM_CHUNK) {
+            evo_checksum_chunk(ctx, crc32(ctx->chunk, EVO_CHECKSUM_CHUNK));
+            ctx->fill = 0;
+        }
+    }
+}
+
+// Feed length bytes of fd starting at offset. Returns -1 on a short read.
+static inline int evo_checksum_file_range(struct evo_checksum *ctx, int fd, uint64_t offset, uint64_t length) {
+    uint8_t buffer[16 * EVO_CHECKSUM_CHUNK];
+    while (length > 0) {
+        size_t n = length < sizeof(buffer) ? (size_t)length : sizeof(buffer);
+        ssize_t bytes_read = pread(fd, buffer, n, offset);
+        if (bytes_read <= 0)
+            return -1;
+        evo_checksum_update(ctx, buffer, bytes_read);
+        offset += bytes_read;
+        length -= bytes_read;
+    }
+    return 0;
+}
+
+static inline uint32_t evo_checksum_final(struct evo_checksum *ctx) {
+    if (ctx->fill > 0) {
+        evo_checksum_chunk(ctx, crc32(ctx->chunk, ctx->fill));
+        ctx->fill = 0;
+    }
+    return ~ctx->value;
+}
+
+#endif // EVO_CHECKSUM_H
@@ -0,0 +1,108 @@
+#ifndef EVO_CHUNKS_H
+#define EVO_CHUNKS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "evo_format.h"
+#include "evo_checksum.h"
+
+// Chunk indexes are a cache: they are replaced with rename() but never
+// flushed, and a reader that finds one torn or stale simply ignores it.
+
+// Number of checksum chunks in a package of package_size bytes
+static inline uint64_t evo_chunk_count(uint64_t package_size) {
+    uint64_t content_size = package_size - sizeof(struct evo_footer);
+    return (content_size + EVO_CHECKSUM_CHUNK - 1) / EVO_CHECKSUM_CHUNK;
+}
+
+// Package checksum from a list of chunk crcs
+static inline uint32_t evo_combine_crcs(const uint32_t *crcs, uint64_t num_chunks) {
+    uint32_t value = 0xffffffff;
+    for (uint64_t i = 0; i < num_chunks; i++)
+        value ^= crcs[i];
+    return ~value;
+}
+
+static inline char *evo_chunks_name(const char *package_path) {
+    size_t size = strlen(package_path) + sizeof(".evo-chunks");
+    char *name = malloc(size);
+    if (name != NULL)
+        snprintf(name, size, "%s.evo-chunks", package_path);
+    return name;
+}
+
+static inline int evo_chunks_save(const char *package_path, uint64_t package_size, const uint32_t *crcs) {
+    char *path = evo_chunks_name(package_path);
+    char *temporary = path ? malloc(strlen(path) + 32) : NULL;
+    if (temporary == NULL) {
+        free(path);
+        return -1;
+    }
+    sprintf(temporary, "%s.evo-new.%d", path, (int)getpid());
+
+    struct evo_chunk_index index;
+    uint64_t num_chunks = evo_chunk_count(package_size);
+    size_t crcs_size = num_chunks * sizeof(uint32_t);
+    memset(&index, 0, sizeof(index));
+    memcpy(index.magic, EVO_CHUNKS_MAGIC, sizeof(index.magic));
+    index.package_size = package_size;
+    index.chunk_size = EVO_CHECKSUM_CHUNK;
+    index.checksum = evo_combine_crcs(crcs, num_chunks);
+
+    int fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    int failed = fd == -1 ||
+        write(fd, &index, sizeof(index)) != sizeof(index) ||
+        write(fd, crcs, crcs_size) != (ssize_t)crcs_size;
+    if (fd != -1 && close(fd) == -1)
+        failed = 1;
+    if (failed || rename(temporary, path) == -1) {
+        unlink(temporary);
+        failed = 1;
+    }
+    free(temporary);
+    free(path);
+    return failed ? -1 : 0;
+}
+
+// Load the chunk index of a package of package_size bytes whose footer
+// holds checksum. On success *crcs holds evo_chunk_count(package_size)
+// entries that the caller must free(). Returns -1 if there is no index or
+// it does not describe that package.
+static inline int evo_chunks_load(const char *package_path, uint64_t package_size, uint32_t checksum,
+                                  uint32_t **crcs) {
+    char *path = evo_chunks_name(package_path);
+    int fd = path ? open(path, O_RDONLY | O_CLOEXEC) : -1;
+    free(path);
+    *crcs = NULL;
+    if (fd == -1)
+        return -1;
+
+    struct evo_chunk_index index;
+    struct stat index_stat;
+    uint64_t num_chunks = evo_chunk_count(package_size);
+    size_t crcs_size = num_chunks * sizeof(uint32_t);
+    if (fstat(fd, &index_stat) == -1 || (uint64_t)index_stat.st_size != sizeof(index) + crcs_size ||
+        pread(fd, &index, sizeof(index), 0) != sizeof(index) ||
+        memcmp(index.magic, EVO_CHUNKS_MAGIC, sizeof(index.magic)) != 0 ||
+        index.package_size != package_size || index.chunk_size != EVO_CHECKSUM_CHUNK ||
+        index.checksum != checksum || (*crcs = malloc(crcs_size > 0 ? crcs_size : 1)) == NULL) {
+        close(fd);
+        return -1;
+    }
+    if (pread(fd, *crcs, crcs_size, sizeof(index)) != (ssize_t)crcs_size ||
+        evo_combine_crcs(*crcs, num_chunks) != checksum) {
+        free(*crcs);
+        *crcs = NULL;
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+#endif // EVO_CHUNKS_H
@@ -5,6 +5,15 @@
 
 #define EVO_MAGIC "EVOFILE"
 
+#define EVO_VERSION 1
+#define EVO_VERSION_SPARSE 2  // Data section ends with an extent table
+#define EVO_VERSION_SLICED 3  // Data section ends with a slice table
+#define EVO_VERSION_TREE 4    // Data section ends with a file table
+
+#define EVO_MAX_SLICES 11     // One slice per supported architecture plus shared
+#define EVO_MAX_SLICE_NAME_LENGTH 32
+#define EVO_SLICE_SHARED "shared"
+
 struct evo_header {
     char magic[8];        // Magic number for .evo files
     uint32_t version;     // Version of the .evo format
@@ -12,8 +21,86 @@ struct evo_header {
     uint64_t data_size;   // Size of the data section
 };
 
+// Sparse packages (EVO_VERSION_SPARSE) store only the allocated ranges of
+// the input. The data section is laid out as:
+//   payload of every extent, back to back in offset order
+//   struct evo_extent[num_extents]
+//   struct evo_extent_table
+// The table sits at the end of the data section so it can be written after
+// a single pass over the input. Everything between extents is a hole and is
+// recreated on extraction. The package checksum already covers the payload
+// and the extent map, so the image itself carries no separate checksum.
+struct evo_extent_table {
+    uint64_t image_size;     // Logical size of the original input
+    uint32_t num_extents;    // Number of entries that precede the table
+    uint32_t reserved;       // Must be zero
+};
+
+struct evo_extent {
+    uint64_t offset;      // Offset of the range in the logical image
+    uint64_t length;      // Length of the range in bytes
+};
+
+// Sliced ("fat") packages (EVO_VERSION_SLICED) carry one payload per
+// architecture plus an optional "shared" payload used by all of them:
+//   payload of every slice, back to back in table order
+//   struct evo_slice[num_slices]
+//   struct evo_slice_table
+// A device only needs the header, metadata, the tables and its own slices,
+// all of which can be located without reading the rest of the file. The
+// table checksum covers the header and metadata too, so they are verified
+// on that path as well.
+struct evo_slice_table {
+    uint32_t num_slices;     // Number of entries that precede the table
+    uint32_t table_checksum; // Checksum of the header, metadata and slice entries
+};
+
+struct evo_slice {
+    char architecture[EVO_MAX_SLICE_NAME_LENGTH]; // Architecture or EVO_SLICE_SHARED
+    uint64_t offset;      // Offset of the slice from the start of the data section
+    uint64_t size;        // Size of the slice in bytes
+    uint32_t checksum;    // Checksum of the slice payload
+    uint32_t reserved;
+};
+
+// File-tree packages (EVO_VERSION_TREE) hold a directory tree:
+//   contents of every regular file and symlink target, back to back
+//   struct evo_file_entry[num_files], sorted by path
+//   path table of NUL-terminated relative paths
+//   struct evo_file_table
+// Each entry carries a SHA-256 digest of its contents so installers can
+// skip files that are already present with the same contents.
+struct evo_file_table {
+    uint32_t num_files;       // Number of entries
+    uint32_t path_table_size; // Size of the path table in bytes
+    uint32_t table_checksum;  // Checksum of the entries and path table
+    uint32_t reserved;
+};
+
+struct evo_file_entry {
+    uint64_t offset;      // Offset of the contents from the start of the data section
+    uint64_t size;        // Size of the contents in bytes
+    uint32_t mode;        // File type and permission bits, as in st_mode
+    uint32_t path_offset; // Offset of the path in the path table
+    uint8_t digest[32];   // SHA-256 of the contents
+};
+
 struct evo_footer {
     uint32_t checksum;    // Checksum for data integrity
 };
 
+// Chunk index, stored next to a package as "<package>.evo-chunks". It holds
+// the crc of every checksum chunk of the package, so that a damaged copy can
+// be compared with a mirror chunk by chunk without reading the mirror's data.
+// The crcs must combine to the package checksum, which is how a stale index
+// is recognised.
+#define EVO_CHUNKS_MAGIC "EVOCHNK"
+
+struct evo_chunk_index {
+    char magic[8];         // "EVOCHNK\0"
+    uint64_t package_size; // Size of the package, footer included
+    uint32_t chunk_size;   // Always EVO_CHECKSUM_CHUNK
+    uint32_t checksum;     // Package checksum the crcs combine to
+};                         // Followed by one uint32_t crc per chunk
+
 #endif // EVO_FORMAT_H
@@ -0,0 +1,543 @@
+#ifndef EVO_INSTALL_H
+#define EVO_INSTALL_H
+
+// syncfs() is a GNU extension, which has to be enabled before any include
+#ifndef _GNU_SOURCE
+#error "evo_install.h requires _GNU_SOURCE to be defined before any #include"
+#endif
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#if __has_include(<linux/openat2.h>)
+#include <linux/openat2.h>
+#endif
+#include "evo_format.h"
+#include "evo_sha256.h"
+#include "evo_tree.h"
+
+// Installs a file-tree package into a root directory. When an install
+// manifest is given, files whose digest and mode match the manifest (and
+// which are still present on disk) are left alone, files that changed are
+// written to a temporary name and renamed into place by a pool of worker
+// threads, and files the new package no longer ships are removed. The
+// manifest is then rewritten to describe the new package.
+//
+// Everything is created relative to a descriptor for the root, and no
+// symlink below the root is ever followed, so neither the package nor
+// whatever is already installed can redirect a write outside of it.
+//
+// The manifest only ever describes files that are on disk: the installed
+// tree is flushed with syncfs() before the new manifest is written, and the
+// manifest itself is flushed before it is renamed into place.
+//
+// Manifest format, one line per entry, sorted by path:
+//   <sha256 hex> <mode octal> <path>
+
+#define EVO_INSTALL_BUFFER_SIZE (1024 * 1024)
+#define EVO_MANIFEST_NAME ".evo-manifest" // Default manifest, in the install root
+
+struct evo_install_stats {
+    uint32_t written;
+    uint32_t unchanged;
+    uint32_t removed;
+    uint64_t bytes_written;
+};
+
+struct evo_manifest_entry {
+    char *path;
+    uint32_t mode;
+    uint8_t digest[EVO_DIGEST_LENGTH];
+};
+
+struct evo_manifest {
+    struct evo_manifest_entry *entries;
+    size_t count;
+};
+
+struct evo_install_job {
+    int package_fd;
+    int root_fd;
+    const struct evo_file_tree *tree;
+    const uint32_t *pending;
+    uint32_t num_pending;
+    uint32_t next;
+    int failed;
+    struct evo_install_stats *stats;
+};
+
+static inline int evo_manifest_compare(const void *a, const void *b) {
+    return strcmp(((const struct evo_manifest_entry *)a)->path, ((const struct evo_manifest_entry *)b)->path);
+}
+
+static inline void evo_manifest_free(struct evo_manifest *manifest) {
+    for (size_t i = 0; i < manifest->count; i++)
+        free(manifest->entries[i].path);
+    free(manifest->entries);
+    manifest->entries = NULL;
+    manifest->count = 0;
+}
+
+// A missing manifest is an empty one: everything gets written
+static inline int evo_manifest_load(const char *path, struct evo_manifest *manifest) {
+    manifest->entries = NULL;
+    manifest->count = 0;
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+        return errno == ENOENT ? 0 : -1;
+
+    size_t capacity = 0;
+    char *line = NULL;
+    size_t line_capacity = 0;
+    ssize_t length;
+    while ((length = getline(&line, &line_capacity, file)) != -1) {
+        if (length > 0 && line[length - 1] == '\n')
+            line[--length] = '\0';
+        char *mode_text = strchr(line, ' ');
+        char *path_text = mode_text ? strchr(mode_text + 1, ' ') : NULL;
+        if (path_text == NULL || mode_text - line != 2 * EVO_DIGEST_LENGTH)
+            continue;
+
+        if (manifest->count == capacity) {
+            capacity = capacity ? capacity * 2 : 256;
+            struct evo_manifest_entry *grown = realloc(manifest->entries, capacity * sizeof(*grown));
+            if (grown == NULL)
+                break;
+            manifest->entries = grown;
+        }
+        struct evo_manifest_entry *entry = &manifest->entries[manifest->count];
+        int valid = 1;
+        for (int i = 0; i < EVO_DIGEST_LENGTH; i++) {
+            unsigned byte;
+            valid &= sscanf(line + 2 * i, "%2x", &byte) == 1;
+            entry->digest[i] = (uint8_t)byte;
+        }
+        entry->mode = (uint32_t)strtoul(mode_text + 1, NULL, 8);
+        entry->path = strdup(path_text + 1);
+        if (!valid || entry->path == NULL || !evo_safe_path(entry->path)) {
+            free(entry->path);
+            continue;
+        }
+        manifest->count++;
+    }
+    free(line);
+    fclose(file);
+    qsort(manifest->entries, manifest->count, sizeof(struct evo_manifest_entry), evo_manifest_compare);
+    return 0;
+}
+
+static inline const struct evo_manifest_entry *evo_manifest_find(const struct evo_manifest *manifest,
+                                                                 const char *path) {
+    struct evo_manifest_entry key;
+    key.path = (char *)path;
+    return manifest->count ? bsearch(&key, manifest->entries, manifest->count,
+                                     sizeof(struct evo_manifest_entry), evo_manifest_compare) : NULL;
+}
+
+// Open the directory holding path, and point *base at its last component
+static inline int evo_open_directory_of(const char *path, const char **base) {
+    char directory[PATH_MAX];
+    const char *slash = strrchr(path, '/');
+    *base = slash ? slash + 1 : path;
+    size_t length = slash == NULL ? 0 : slash == path ? 1 : (size_t)(slash - path);
+    if (length >= sizeof(directory)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memcpy(directory, path, length);
+    directory[length] = '\0';
+    return open(length ? directory : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+}
+
+// Write the manifest next to its final name, flush it and rename it into
+// place, then flush the rename
+static inline int evo_manifest_save(const char *path, const struct evo_file_tree *tree) {
+    char temporary[PATH_MAX];
+    if (path == NULL ||
+        snprintf(temporary, sizeof(temporary), "%s.evo-new.%d", path, (int)getpid()) >= (int)sizeof(temporary))
+        return -1;
+    FILE *file = fopen(temporary, "w");
+    if (file == NULL)
+        return -1;
+    for (uint32_t i = 0; i < tree->table.num_files; i++) {
+        for (int j = 0; j < EVO_DIGEST_LENGTH; j++)
+            fprintf(file, "%02x", tree->entries[i].digest[j]);
+        fprintf(file, " %o %s\n", tree->entries[i].mode, evo_file_path(tree, i));
+    }
+    int failed = fflush(file) != 0 || fsync(fileno(file)) == -1;
+    if (fclose(file) != 0 || failed || rename(temporary, path) == -1) {
+        unlink(temporary);
+        return -1;
+    }
+    const char *base;
+    int dir_fd = evo_open_directory_of(path, &base);
+    if (dir_fd == -1)
+        return -1;
+    failed = fsync(dir_fd) == -1;
+    close(dir_fd);
+    return failed ? -1 : 0;
+}
+
+// A manifest kept inside the install root must not share its name with a
+// top-level entry of the package, or installing one would overwrite the
+// other. Returns 1 if they collide.
+static inline int evo_manifest_collides(const char *path, int root_fd, const struct evo_file_tree *tree) {
+    const char *base;
+    struct stat root_stat, dir_stat;
+    int dir_fd = evo_open_directory_of(path, &base);
+    if (dir_fd == -1)
+        return 0;
+    int same = fstat(dir_fd, &dir_stat) == 0 && fstat(root_fd, &root_stat) == 0 &&
+        dir_stat.st_dev == root_stat.st_dev && dir_stat.st_ino == root_stat.st_ino;
+    close(dir_fd);
+    return same && evo_find_file(tree, base, strlen(base)) != -1;
+}
+
+static inline int evo_tree_find(const struct evo_file_tree *tree, const char *path) {
+    return evo_find_file(tree, path, strlen(path));
+}
+
+// Open the directory holding relative, following no symlinks below root.
+// *base is set to the last component of relative.
+static inline int evo_open_parent(int root_fd, const char *relative, const char **base) {
+    const char *slash = strrchr(relative, '/');
+    *base = slash ? slash + 1 : relative;
+    if (slash == NULL)
+        return fcntl(root_fd, F_DUPFD_CLOEXEC, 0);
+
+    char parent[PATH_MAX];
+    if ((size_t)(slash - relative) >= sizeof(parent)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memcpy(parent, relative, slash - relative);
+    parent[slash - relative] = '\0';
+
+#if defined(SYS_openat2) && defined(RESOLVE_NO_SYMLINKS)
+    struct open_how how;
+    memset(&how, 0, sizeof(how));
+    how.flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC;
+    how.resolve = RESOLVE_BENEATH | RESOLVE_NO_SYMLINKS;
+    int fd = (int)syscall(SYS_openat2, root_fd, parent, &how, sizeof(how));
+    if (fd != -1 || (errno != ENOSYS && errno != EPERM))
+        return fd;
+#endif
+
+    // No openat2(): walk the path one component at a time
+    int dir_fd = fcntl(root_fd, F_DUPFD_CLOEXEC, 0);
+    for (char *component = strtok(parent, "/"); component != NULL && dir_fd != -1;
+         component = strtok(NULL, "/")) {
+        int next = openat(dir_fd, component, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        int saved_errno = errno;
+        close(dir_fd);
+        errno = saved_errno;
+        dir_fd = next;
+    }
+    return dir_fd;
+}
+
+// Write one regular file or symlink under a temporary name, check its
+// digest and rename it over the old one
+static inline int evo_install_file(const struct evo_install_job *job, uint32_t index, uint8_t *buffer) {
+    const struct evo_file_entry *entry = &job->tree->entries[index];
+    const char *relative = evo_file_path(job->tree, index);
+    const char *base;
+    char temporary[NAME_MAX + 1];
+    int dir_fd = evo_open_parent(job->root_fd, relative, &base);
+    if (dir_fd == -1) {
+        perror(relative);
+        return -1;
+    }
+    if (snprintf(temporary, sizeof(temporary), ".%s.evo-new.%d", base, (int)getpid()) >= (int)sizeof(temporary)) {
+        fprintf(stderr, "%s: path too long\n", relative);
+        close(dir_fd);
+        return -1;
+    }
+
+    struct evo_sha256 sha;
+    uint8_t digest[EVO_DIGEST_LENGTH];
+    evo_sha256_init(&sha);
+    uint64_t offset = job->tree->data_offset + entry->offset;
+    unlinkat(dir_fd, temporary, 0);
+
+    if (S_ISLNK(entry->mode)) {
+        char target[PATH_MAX];
+        if (entry->size >= sizeof(target) ||
+            pread(job->package_fd, target, entry->size, offset) != (ssize_t)entry->size) {
+            fprintf(stderr, "%s: error reading symlink target\n", relative);
+            close(dir_fd);
+            return -1;
+        }
+        target[entry->size] = '\0';
+        evo_sha256_update(&sha, target, entry->size);
+        evo_sha256_final(&sha, digest);
+        if (memcmp(digest, entry->digest, EVO_DIGEST_LENGTH) != 0) {
+            fprintf(stderr, "%s: digest mismatch\n", relative);
+            close(dir_fd);
+            return -1;
+        }
+        if (symlinkat(target, dir_fd, temporary) == -1) {
+            perror(relative);
+            close(dir_fd);
+            return -1;
+        }
+    } else {
+        int fd = openat(dir_fd, temporary, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC,
+                        entry->mode & 07777);
+        if (fd == -1) {
+            perror(relative);
+            close(dir_fd);
+            return -1;
+        }
+        uint64_t remaining = entry->size;
+        while (remaining > 0) {
+            size_t chunk = remaining < EVO_INSTALL_BUFFER_SIZE ? (size_t)remaining : EVO_INSTALL_BUFFER_SIZE;
+            ssize_t bytes_read = pread(job->package_fd, buffer, chunk, offset);
+            if (bytes_read <= 0 || write(fd, buffer, bytes_read) != bytes_read) {
+                fprintf(stderr, "%s: error writing file\n", relative);
+                close(fd);
+                unlinkat(dir_fd, temporary, 0);
+                close(dir_fd);
+                return -1;
+            }
+            evo_sha256_update(&sha, buffer, bytes_read);
+            offset += bytes_read;
+            remaining -= bytes_read;
+        }
+        evo_sha256_final(&sha, digest);
+        // Apply the exact mode, which the umask may have narrowed
+        if (fchmod(fd, entry->mode & 07777) == -1 || close(fd) == -1) {
+            perror(relative);
+            unlinkat(dir_fd, temporary, 0);
+            close(dir_fd);
+            return -1;
+        }
+        if (memcmp(digest, entry->digest, EVO_DIGEST_LENGTH) != 0) {
+            fprintf(stderr, "%s: digest mismatch\n", relative);
+            unlinkat(dir_fd, temporary, 0);
+            close(dir_fd);
+            return -1;
+        }
+    }
+
+    // An empty directory left in the way (with no manifest to say it was
+    // ours) is replaced as well
+    int result = renameat(dir_fd, temporary, dir_fd, base);
+    if (result == -1 && (errno == EISDIR || errno == ENOTEMPTY || errno == EEXIST) &&
+        unlinkat(dir_fd, base, AT_REMOVEDIR) == 0)
+        result = renameat(dir_fd, temporary, dir_fd, base);
+    if (result == -1) {
+        perror(relative);
+        unlinkat(dir_fd, temporary, 0);
+        close(dir_fd);
+        return -1;
+    }
+    close(dir_fd);
+    __atomic_fetch_add(&job->stats->written, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&job->stats->bytes_written, entry->size, __ATOMIC_RELAXED);
+    return 0;
+}
+
+static inline void *evo_install_worker(void *arg) {
+    struct evo_install_job *job = arg;
+    uint8_t *buffer = malloc(EVO_INSTALL_BUFFER_SIZE);
+    if (buffer == NULL) {
+        __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    for (;;) {
+        uint32_t next = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+        if (next >= job->num_pending || __atomic_load_n(&job->failed, __ATOMIC_RELAXED))
+            break;
+        if (evo_install_file(job, job->pending[next], buffer) == -1)
+            __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+    }
+    free(buffer);
+    return NULL;
+}
+
+// Create or fix up one directory. Anything else in its place is removed.
+static inline int evo_install_directory(int root_fd, const char *relative, uint32_t mode) {
+    const char *base;
+    struct stat path_stat;
+    int dir_fd = evo_open_parent(root_fd, relative, &base);
+    if (dir_fd == -1) {
+        perror(relative);
+        return -1;
+    }
+    if (fstatat(dir_fd, base, &path_stat, AT_SYMLINK_NOFOLLOW) == 0 && !S_ISDIR(path_stat.st_mode) &&
+        unlinkat(dir_fd, base, 0) == -1) {
+        perror(relative);
+        close(dir_fd);
+        return -1;
+    }
+    if (mkdirat(dir_fd, base, mode & 07777) == -1 && errno != EEXIST) {
+        perror(relative);
+        close(dir_fd);
+        return -1;
+    }
+    int fd = openat(dir_fd, base, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    close(dir_fd);
+    if (fd == -1 || fstat(fd, &path_stat) == -1 ||
+        ((path_stat.st_mode & 07777) != (mode & 07777) && fchmod(fd, mode & 07777) == -1)) {
+        perror(relative);
+        if (fd != -1)
+            close(fd);
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+// lstat() of relative below root, following no symlinks on the way
+static inline int evo_install_stat(int root_fd, const char *relative, struct stat *path_stat) {
+    const char *base;
+    int dir_fd = evo_open_parent(root_fd, relative, &base);
+    if (dir_fd == -1)
+        return -1;
+    int result = fstatat(dir_fd, base, path_stat, AT_SYMLINK_NOFOLLOW);
+    close(dir_fd);
+    return result;
+}
+
+// Remove an installed entry. Returns 0 if it was removed.
+static inline int evo_install_remove(int root_fd, const char *relative, uint32_t mode) {
+    const char *base;
+    int dir_fd = evo_open_parent(root_fd, relative, &base);
+    if (dir_fd == -1)
+        return -1;
+    int result = unlinkat(dir_fd, base, S_ISDIR(mode) ? AT_REMOVEDIR : 0);
+    close(dir_fd);
+    return result;
+}
+
+// Install the tree of a file-tree package under the directory root_fd.
+// manifest_path may be NULL, in which case every file is written and no
+// manifest is kept.
+static inline int evo_install_tree_at(int package_fd, const struct evo_header *header, int root_fd,
+                                      const char *manifest_path, unsigned jobs, struct evo_install_stats *stats) {
+    struct evo_file_tree tree;
+    struct evo_manifest manifest = {NULL, 0};
+    memset(stats, 0, sizeof(*stats));
+    if (evo_load_file_tree(package_fd, header, &tree) == -1) {
+        fprintf(stderr, "Error reading file table\n");
+        return -1;
+    }
+    if (manifest_path != NULL && evo_manifest_collides(manifest_path, root_fd, &tree)) {
+        fprintf(stderr, "Package contains %s, which is the install manifest\n", manifest_path);
+        evo_free_file_tree(&tree);
+        return -1;
+    }
+    if (manifest_path != NULL && evo_manifest_load(manifest_path, &manifest) == -1) {
+        perror("Error reading install manifest");
+        evo_free_file_tree(&tree);
+        return -1;
+    }
+
+    uint32_t *pending = malloc((tree.table.num_files + 1) * sizeof(uint32_t));
+    if (pending == NULL) {
+        evo_manifest_free(&manifest);
+        evo_free_file_tree(&tree);
+        return -1;
+    }
+
+    // Remove what the old package had and the new one does not, or has with
+    // a different type, before anything takes its place. Children go before
+    // their directories.
+    for (size_t i = manifest.count; i-- > 0;) {
+        const struct evo_manifest_entry *installed = &manifest.entries[i];
+        int index = evo_tree_find(&tree, installed->path);
+        if (index != -1 && (tree.entries[index].mode & S_IFMT) == (installed->mode & S_IFMT))
+            continue;
+        if (evo_install_remove(root_fd, installed->path, installed->mode) == 0 && index == -1)
+            stats->removed++;
+    }
+
+    // Directories come before their contents in path order, so they are
+    // created up front; files are compared against the manifest
+    int failed = 0;
+    uint32_t num_pending = 0;
+    for (uint32_t i = 0; i < tree.table.num_files && !failed; i++) {
+        const struct evo_file_entry *entry = &tree.entries[i];
+        const char *relative = evo_file_path(&tree, i);
+        if (S_ISDIR(entry->mode)) {
+            failed = evo_install_directory(root_fd, relative, entry->mode) == -1;
+            continue;
+        }
+
+        const struct evo_manifest_entry *installed = evo_manifest_find(&manifest, relative);
+        if (installed != NULL && installed->mode == entry->mode &&
+            memcmp(installed->digest, entry->digest, EVO_DIGEST_LENGTH) == 0) {
+            struct stat path_stat;
+            if (evo_install_stat(root_fd, relative, &path_stat) == 0 &&
+                (path_stat.st_mode & S_IFMT) == (entry->mode & S_IFMT) &&
+                (!S_ISREG(entry->mode) || (uint64_t)path_stat.st_size == entry->size)) {
+                stats->unchanged++;
+                continue;
+            }
+        }
+        pending[num_pending++] = i;
+    }
+
+    // Write the changed files in parallel
+    if (!failed && num_pending > 0) {
+        struct evo_install_job job = {package_fd, root_fd, &tree, pending, num_pending, 0, 0, stats};
+        if (jobs == 0)
+            jobs = 1;
+        if (jobs > num_pending)
+            jobs = num_pending;
+        pthread_t *threads = malloc(jobs * sizeof(pthread_t));
+        unsigned started = 0;
+        if (threads != NULL) {
+            for (; started < jobs; started++) {
+                if (pthread_create(&threads[started], NULL, evo_install_worker, &job) != 0)
+                    break;
+            }
+        }
+        if (started == 0)
+            evo_install_worker(&job);
+        for (unsigned t = 0; t < started; t++)
+            pthread_join(threads[t], NULL);
+        free(threads);
+        failed = job.failed;
+    }
+    free(pending);
+
+    // Everything the manifest is about to list must be on disk first
+    if (manifest_path != NULL && !failed && syncfs(root_fd) == -1) {
+        perror("Error flushing installed files");
+        failed = 1;
+    }
+    if (manifest_path != NULL && !failed && evo_manifest_save(manifest_path, &tree) == -1) {
+        perror("Error writing install manifest");
+        failed = 1;
+    }
+    evo_manifest_free(&manifest);
+    evo_free_file_tree(&tree);
+    return failed ? -1 : 0;
+}
+
+// Install the tree of a file-tree package under root, creating root if needed
+static inline int evo_install_tree(int package_fd, const struct evo_header *header, const char *root,
+                                   const char *manifest_path, unsigned jobs, struct evo_install_stats *stats) {
+    int root_fd = -1;
+    if ((mkdir(root, 0755) == -1 && errno != EEXIST) ||
+        (root_fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1) {
+        perror("Error opening install root");
+        memset(stats, 0, sizeof(*stats));
+        return -1;
+    }
+    int result = evo_install_tree_at(package_fd, header, root_fd, manifest_path, jobs, stats);
+    close(root_fd);
+    return result;
+}
+
+#endif // EVO_INSTALL_H
@@ -0,0 +1,566 @@
+#ifndef EVO_OUTPUT_H
+#define EVO_OUTPUT_H
+
+// O_TMPFILE and syncfs() are GNU extensions
+#ifndef _GNU_SOURCE
+#error "evo_output.h requires _GNU_SOURCE to be defined before any #include"
+#endif
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include "evo_checksum.h"
+
+// Crash-safe package output. A package is written to an unnamed O_TMPFILE
+// (or a temporary name where the filesystem lacks it) in the directory of
+// its final path, and only appears under that path once it is complete:
+//
+//   evo_output_publish() flushes a single file, renames it into place and
+//   syncs the directory.
+//
+//   evo_output_stage() gives a finished file its temporary name without
+//   flushing it, and evo_output_commit() later makes a whole batch durable
+//   with one syncfs() per filesystem before renaming every file into place,
+//   so bulk runs pay for a few flushes rather than one per package.
+//
+// Rewriting a whole package to change a few kilobytes is wasteful where
+// the filesystem cannot reflink it, so small in-place changes can instead
+// go through a journal, "<path>.evo-journal" (see evo_output_patch()).
+// The journal is made durable before the package is touched and removed
+// only once the patched package is, so an interrupted patch is finished by
+// evo_journal_recover(). Every tool opens packages with evo_open_package(),
+// which recovers first, so none of them reads a half-patched package.
+//
+// A crash at any point leaves either the old package or the new one, plus
+// at most a stray "<path>.evo-new.*" file, or a journal that completes the
+// new one the next time the package is opened.
+
+#define EVO_JOURNAL_MAGIC "EVOJRN2"
+#define EVO_JOURNAL_MAX_RANGES 4
+
+// A journal names the package it applies to by size, device and inode,
+// and by the contents of its last range (the footer checksum for evo-modify)
+// before and after the patch, so one left for an earlier package under the
+// same name is never applied to a later one.
+struct evo_journal_header {
+    char magic[8];
+    uint64_t package_size;
+    uint64_t package_dev;
+    uint64_t package_ino;
+    uint32_t old_tail;     // Checksum of the last range before the patch
+    uint32_t new_tail;     // and after it
+    uint32_t num_ranges;
+    uint32_t checksum;     // Checksum of the journal with this field zero
+};
+
+// Followed by num_ranges struct evo_journal_range, then the data of each
+struct evo_journal_range {
+    uint64_t offset;
+    uint64_t length;
+};
+
+struct evo_output {
+    int fd;
+    const char *path;  // Final path, owned by the caller
+    char *temp_path;   // Temporary name (or journal), NULL while unnamed
+    int journaled;     // The output patches path in place via temp_path
+};
+
+static inline void evo_output_dir(const char *path, char *dir, size_t size) {
+    const char *slash = strrchr(path, '/');
+    if (slash == NULL)
+        snprintf(dir, size, ".");
+    else if (slash == path)
+        snprintf(dir, size, "/");
+    else
+        snprintf(dir, size, "%.*s", (int)(slash - path), path);
+}
+
+static inline char *evo_output_temp_name(const char *path) {
+    static unsigned counter;
+    size_t size = strlen(path) + 48;
+    char *name = malloc(size);
+    if (name != NULL)
+        snprintf(name, size, "%s.evo-new.%d.%u", path, (int)getpid(),
+                 __atomic_fetch_add(&counter, 1, __ATOMIC_RELAXED));
+    return name;
+}
+
+static inline int evo_output_open(struct evo_output *output, const char *path) {
+    char dir[PATH_MAX];
+    output->path = path;
+    output->temp_path = NULL;
+    output->journaled = 0;
+    evo_output_dir(path, dir, sizeof(dir));
+    output->fd = open(dir, O_TMPFILE | O_RDWR, 0644);
+    if (output->fd != -1)
+        return 0;
+    if (errno != EOPNOTSUPP && errno != EISDIR && errno != EINVAL)
+        return -1;
+
+    // No O_TMPFILE support: fall back to a named temporary file
+    output->temp_path = evo_output_temp_name(path);
+    if (output->temp_path == NULL)
+        return -1;
+    output->fd = open(output->temp_path, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (output->fd == -1) {
+        free(output->temp_path);
+        output->temp_path = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+// Discard an unpublished output
+static inline void evo_output_abort(struct evo_output *output) {
+    if (output->fd != -1)
+        close(output->fd);
+    if (output->temp_path != NULL) {
+        unlink(output->temp_path);
+        free(output->temp_path);
+    }
+    output->fd = -1;
+    output->temp_path = NULL;
+}
+
+// Give an unnamed file its temporary name
+static inline int evo_output_link(struct evo_output *output) {
+    if (output->temp_path != NULL)
+        return 0;
+    char proc_path[64];
+    snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", output->fd);
+    for (int attempt = 0; attempt < 100; attempt++) {
+        output->temp_path = evo_output_temp_name(output->path);
+        if (output->temp_path == NULL)
+            return -1;
+        if (linkat(AT_FDCWD, proc_path, AT_FDCWD, output->temp_path, AT_SYMLINK_FOLLOW) == 0)
+            return 0;
+        int saved_errno = errno;
+        free(output->temp_path);
+        output->temp_path = NULL;
+        if (saved_errno != EEXIST) {
+            errno = saved_errno;
+            return -1;
+        }
+    }
+    errno = EEXIST;
+    return -1;
+}
+
+static inline int evo_output_sync_dir(const char *path) {
+    char dir[PATH_MAX];
+    evo_output_dir(path, dir, sizeof(dir));
+    int dir_fd = open(dir, O_RDONLY | O_DIRECTORY);
+    if (dir_fd == -1)
+        return -1;
+    int result = fsync(dir_fd);
+    close(dir_fd);
+    return result;
+}
+
+// Name and close a finished output, leaving durability to evo_output_commit()
+static inline int evo_output_stage(struct evo_output *output) {
+    if (evo_output_link(output) == -1) {
+        evo_output_abort(output);
+        return -1;
+    }
+    int result = close(output->fd);
+    output->fd = -1;
+    if (result == -1)
+        evo_output_abort(output);
+    return result;
+}
+
+// Flush a single output and atomically replace its final path
+static inline int evo_output_publish(struct evo_output *output) {
+    if (fdatasync(output->fd) == -1 || evo_output_stage(output) == -1 ||
+        rename(output->temp_path, output->path) == -1) {
+        evo_output_abort(output);
+        return -1;
+    }
+    free(output->temp_path);
+    output->temp_path = NULL;
+    return evo_output_sync_dir(output->path);
+}
+
+static inline char *evo_journal_name(const char *path) {
+    size_t size = strlen(path) + sizeof(".evo-journal");
+    char *name = malloc(size);
+    if (name != NULL)
+        snprintf(name, size, "%s.evo-journal", path);
+    return name;
+}
+
+// Checksum of the bytes of range in fd
+static inline int evo_journal_tail(int fd, const struct evo_journal_range *range, uint32_t *tail) {
+    struct evo_checksum ctx;
+    evo_checksum_init(&ctx);
+    if (evo_checksum_file_range(&ctx, fd, range->offset, range->length) == -1)
+        return -1;
+    *tail = evo_checksum_final(&ctx);
+    return 0;
+}
+
+static inline uint32_t evo_journal_checksum(const struct evo_journal_header *header, const void *rest,
+                                            size_t rest_size, const void *const *data,
+                                            const struct evo_journal_range *ranges) {
+    struct evo_journal_header zeroed = *header;
+    struct evo_checksum ctx;
+    zeroed.checksum = 0;
+    evo_checksum_init(&ctx);
+    evo_checksum_update(&ctx, &zeroed, sizeof(zeroed));
+    evo_checksum_update(&ctx, rest, rest_size);
+    for (uint32_t i = 0; data != NULL && i < header->num_ranges; i++)
+        evo_checksum_update(&ctx, data[i], ranges[i].length);
+    return evo_checksum_final(&ctx);
+}
+
+static inline int evo_journal_write(const char *journal_path, const char *path, uint64_t package_size,
+                                    const struct evo_journal_range *ranges, const void *const *data,
+                                    uint32_t num_ranges, int sync) {
+    struct evo_journal_header header;
+    struct stat package_stat;
+    struct evo_checksum ctx;
+    if (num_ranges == 0 || num_ranges > EVO_JOURNAL_MAX_RANGES) {
+        errno = EINVAL;
+        return -1;
+    }
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, EVO_JOURNAL_MAGIC, sizeof(header.magic));
+    header.package_size = package_size;
+    header.num_ranges = num_ranges;
+
+    int package_fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (package_fd == -1)
+        return -1;
+    int failed = fstat(package_fd, &package_stat) == -1;
+    if (!failed && (uint64_t)package_stat.st_size != package_size) {
+        errno = ESTALE;
+        failed = 1;
+    }
+    if (!failed && evo_journal_tail(package_fd, &ranges[num_ranges - 1], &header.old_tail) == -1)
+        failed = 1;
+    close(package_fd);
+    if (failed)
+        return -1;
+    header.package_dev = package_stat.st_dev;
+    header.package_ino = package_stat.st_ino;
+    evo_checksum_init(&ctx);
+    evo_checksum_update(&ctx, data[num_ranges - 1], ranges[num_ranges - 1].length);
+    header.new_tail = evo_checksum_final(&ctx);
+    header.checksum = evo_journal_checksum(&header, ranges, num_ranges * sizeof(*ranges), data, ranges);
+
+    int fd = open(journal_path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd == -1)
+        return -1;
+    failed = write(fd, &header, sizeof(header)) != sizeof(header) ||
+        write(fd, ranges, num_ranges * sizeof(*ranges)) != (ssize_t)(num_ranges * sizeof(*ranges));
+    for (uint32_t i = 0; i < num_ranges && !failed; i++)
+        failed = write(fd, data[i], ranges[i].length) != (ssize_t)ranges[i].length;
+    if (sync && !failed && fdatasync(fd) == -1)
+        failed = 1;
+    if (close(fd) == -1)
+        failed = 1;
+    if (!failed && sync && evo_output_sync_dir(journal_path) == -1)
+        failed = 1;
+    if (failed) {
+        int saved_errno = errno;
+        unlink(journal_path);
+        errno = saved_errno;
+        return -1;
+    }
+    return 0;
+}
+
+// Remove a journal once its package is durable, and make the removal
+// durable too so that it cannot reappear after a crash
+static inline int evo_journal_remove(const char *journal_path) {
+    if (unlink(journal_path) == -1 && errno != ENOENT)
+        return -1;
+    return evo_output_sync_dir(journal_path);
+}
+
+// Apply a journal to its package. Returns 1 if it was applied, 0 if there
+// was no usable journal (a torn or stale one is discarded) and -1 on error,
+// including a valid journal for a package the caller cannot write.
+// The journal itself is left for the caller to remove.
+static inline int evo_journal_replay(const char *path, const char *journal_path, int sync) {
+    int fd = open(journal_path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd == -1)
+        return errno == ENOENT ? 0 : -1;
+    struct stat journal_stat, package_stat;
+    int writable = 1;
+    int package_fd = open(path, O_RDWR | O_CLOEXEC);
+    if (package_fd == -1 && (errno == EACCES || errno == EPERM || errno == EROFS)) {
+        writable = 0;
+        package_fd = open(path, O_RDONLY | O_CLOEXEC);
+    }
+    if (package_fd == -1 || fstat(fd, &journal_stat) == -1 || fstat(package_fd, &package_stat) == -1) {
+        int saved_errno = errno;
+        if (package_fd != -1)
+            close(package_fd);
+        close(fd);
+        errno = saved_errno;
+        return -1;
+    }
+
+    // Only a journal written by the package's owner or by root is trusted.
+    // Tools running as root recover packages as they open them, and must
+    // not apply one planted by a user who may write the directory but not
+    // the package.
+    if (!S_ISREG(journal_stat.st_mode) ||
+        (journal_stat.st_uid != 0 && journal_stat.st_uid != package_stat.st_uid)) {
+        close(package_fd);
+        close(fd);
+        return 0;
+    }
+    uint8_t *journal = malloc(journal_stat.st_size > 0 ? journal_stat.st_size : 1);
+    if (journal == NULL ||
+        pread(fd, journal, journal_stat.st_size, 0) != journal_stat.st_size) {
+        free(journal);
+        close(package_fd);
+        close(fd);
+        return -1;
+    }
+    close(fd);
+
+    // A journal that is incomplete was never made durable, so the package
+    // was not touched. One for another file, or whose last range holds
+    // neither its old nor its new contents, is stale.
+    struct evo_journal_header header;
+    const struct evo_journal_range *ranges = (const struct evo_journal_range *)(journal + sizeof(header));
+    int valid = (size_t)journal_stat.st_size >= sizeof(header);
+    if (valid) {
+        memcpy(&header, journal, sizeof(header));
+        valid = memcmp(header.magic, EVO_JOURNAL_MAGIC, sizeof(header.magic)) == 0 &&
+            header.num_ranges > 0 && header.num_ranges <= EVO_JOURNAL_MAX_RANGES &&
+            header.package_size == (uint64_t)package_stat.st_size &&
+            header.package_dev == (uint64_t)package_stat.st_dev &&
+            header.package_ino == (uint64_t)package_stat.st_ino &&
+            (size_t)journal_stat.st_size >= sizeof(header) + header.num_ranges * sizeof(*ranges);
+    }
+    uint64_t data_size = 0;
+    for (uint32_t i = 0; valid && i < header.num_ranges; i++) {
+        valid = ranges[i].length <= (uint64_t)journal_stat.st_size &&
+            ranges[i].offset <= header.package_size && ranges[i].length <= header.package_size - ranges[i].offset;
+        data_size += ranges[i].length;
+    }
+    if (valid) {
+        size_t table_size = sizeof(header) + header.num_ranges * sizeof(*ranges);
+        valid = data_size == (uint64_t)journal_stat.st_size - table_size &&
+            evo_journal_checksum(&header, ranges, journal_stat.st_size - sizeof(header), NULL, NULL) ==
+                header.checksum;
+    }
+    if (valid) {
+        uint32_t tail;
+        if (evo_journal_tail(package_fd, &ranges[header.num_ranges - 1], &tail) == -1) {
+            free(journal);
+            close(package_fd);
+            return -1;
+        }
+        valid = tail == header.old_tail || tail == header.new_tail;
+    }
+    if (!valid) {
+        free(journal);
+        close(package_fd);
+        evo_journal_remove(journal_path);
+        return 0;
+    }
+    if (!writable) {
+        free(journal);
+        close(package_fd);
+        errno = EACCES;
+        return -1;
+    }
+
+    const uint8_t *data = journal + sizeof(header) + header.num_ranges * sizeof(*ranges);
+    int failed = 0;
+    for (uint32_t i = 0; i < header.num_ranges && !failed; i++) {
+        failed = pwrite(package_fd, data, ranges[i].length, ranges[i].offset) != (ssize_t)ranges[i].length;
+        data += ranges[i].length;
+    }
+    if (!failed && sync && fdatasync(package_fd) == -1)
+        failed = 1;
+    if (close(package_fd) == -1)
+        failed = 1;
+    free(journal);
+    return failed ? -1 : 1;
+}
+
+// Finish a patch of path that was interrupted. Returns 1 if one was
+// finished, 0 if there was none and -1 on error.
+static inline int evo_journal_recover(const char *path) {
+    char *journal_path = evo_journal_name(path);
+    if (journal_path == NULL)
+        return -1;
+    int result = evo_journal_replay(path, journal_path, 1);
+    if (result == 1 && evo_journal_remove(journal_path) == -1)
+        result = -1;
+    free(journal_path);
+    return result;
+}
+
+// Open a package, first finishing a patch of it that was interrupted
+static inline int evo_open_package(const char *path, int flags) {
+    if (evo_journal_recover(path) == -1)
+        return -1;
+    return open(path, flags);
+}
+
+// Patch ranges of an existing package in place through a journal. With
+// publish set the patch is applied and made durable at once; otherwise only
+// the journal is written and evo_output_commit() applies it.
+static inline int evo_output_patch(struct evo_output *output, const char *path, uint64_t package_size,
+                                   const struct evo_journal_range *ranges, const void *const *data,
+                                   uint32_t num_ranges, int publish) {
+    output->fd = -1;
+    output->path = path;
+    output->journaled = 1;
+    output->temp_path = evo_journal_name(path);
+    if (output->temp_path == NULL)
+        return -1;
+    if (evo_journal_write(output->temp_path, path, package_size, ranges, data, num_ranges, publish) == -1) {
+        free(output->temp_path);
+        output->temp_path = NULL;
+        return -1;
+    }
+    if (!publish)
+        return 0;
+
+    // Once the journal is durable a failed replay is left for recovery
+    int result = evo_journal_replay(path, output->temp_path, 1);
+    if (result == 1 && evo_journal_remove(output->temp_path) == -1)
+        result = -1;
+    free(output->temp_path);
+    output->temp_path = NULL;
+    return result == 1 ? 0 : -1;
+}
+
+// syncfs() once for every filesystem holding a staged output
+static inline int evo_output_sync_filesystems(const struct evo_output *outputs, size_t count) {
+    size_t num_devices = 0;
+    dev_t *devices = malloc((count > 0 ? count : 1) * sizeof(dev_t));
+    char dir[PATH_MAX];
+    char last_dir[PATH_MAX] = "";
+    if (devices == NULL)
+        return -1;
+
+    for (size_t i = 0; i < count; i++) {
+        if (outputs[i].temp_path == NULL)
+            continue;
+        evo_output_dir(outputs[i].path, dir, sizeof(dir));
+        if (strcmp(dir, last_dir) == 0)
+            continue;
+        snprintf(last_dir, sizeof(last_dir), "%s", dir);
+
+        struct stat dir_stat;
+        int dir_fd = open(dir, O_RDONLY | O_DIRECTORY);
+        if (dir_fd == -1 || fstat(dir_fd, &dir_stat) == -1) {
+            if (dir_fd != -1)
+                close(dir_fd);
+            free(devices);
+            return -1;
+        }
+        size_t d = 0;
+        while (d < num_devices && devices[d] != dir_stat.st_dev)
+            d++;
+        if (d == num_devices) {
+            devices[num_devices++] = dir_stat.st_dev;
+            if (syncfs(dir_fd) == -1) {
+                close(dir_fd);
+                free(devices);
+                return -1;
+            }
+        }
+        close(dir_fd);
+    }
+    free(devices);
+    return 0;
+}
+
+// Group commit for staged outputs. Entries without a temporary name (failed
+// or aborted) are skipped. Every filesystem holding a staged file or
+// journal is flushed once. Then the files are renamed into place and their
+// directories synced. Journals are applied to their packages, and after a
+// second flush the journals are removed.
+// Returns the number of outputs that could not be published.
+static inline size_t evo_output_commit(struct evo_output *outputs, size_t count) {
+    size_t failures = 0;
+    char dir[PATH_MAX];
+    char last_dir[PATH_MAX] = "";
+
+    if (evo_output_sync_filesystems(outputs, count) == -1) {
+        perror("Error flushing outputs");
+        for (size_t i = 0; i < count; i++) {
+            if (outputs[i].temp_path != NULL) {
+                evo_output_abort(&outputs[i]);
+                failures++;
+            }
+        }
+        return failures;
+    }
+
+    int patched = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (outputs[i].temp_path == NULL)
+            continue;
+        if (outputs[i].journaled) {
+            // A failed replay keeps its journal for recovery
+            if (evo_journal_replay(outputs[i].path, outputs[i].temp_path, 0) != 1) {
+                perror(outputs[i].path);
+                free(outputs[i].temp_path);
+                outputs[i].temp_path = NULL;
+                failures++;
+            }
+            patched = 1;
+            continue;
+        }
+        if (rename(outputs[i].temp_path, outputs[i].path) == -1) {
+            perror(outputs[i].path);
+            evo_output_abort(&outputs[i]);
+            failures++;
+            continue;
+        }
+        free(outputs[i].temp_path);
+        outputs[i].temp_path = NULL;
+
+        evo_output_dir(outputs[i].path, dir, sizeof(dir));
+        if (strcmp(dir, last_dir) != 0) {
+            snprintf(last_dir, sizeof(last_dir), "%s", dir);
+            if (evo_output_sync_dir(outputs[i].path) == -1)
+                failures++;
+        }
+    }
+
+    // Journals go only once the patched packages are durable
+    int synced = !patched || evo_output_sync_filesystems(outputs, count) == 0;
+    if (!synced)
+        perror("Error flushing outputs");
+    last_dir[0] = '\0';
+    for (size_t i = 0; i < count; i++) {
+        if (outputs[i].temp_path == NULL)
+            continue;
+        if (!synced) {
+            failures++;
+        } else {
+            unlink(outputs[i].temp_path);
+            evo_output_dir(outputs[i].path, dir, sizeof(dir));
+            if (strcmp(dir, last_dir) != 0) {
+                snprintf(last_dir, sizeof(last_dir), "%s", dir);
+                if (evo_output_sync_dir(outputs[i].path) == -1)
+                    failures++;
+            }
+        }
+        free(outputs[i].temp_path);
+        outputs[i].temp_path = NULL;
+    }
+    return failures;
+}
+
+#endif // EVO_OUTPUT_H
@@ -0,0 +1,102 @@
+#ifndef EVO_SLICE_H
+#define EVO_SLICE_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "evo_format.h"
+#include "evo_metadata.h"
+#include "evo_checksum.h"
+
+// Offset of the data section from the start of the package
+static inline uint64_t evo_data_offset(const struct evo_header *header) {
+    return sizeof(struct evo_header) + header->metadata_size;
+}
+
+// Slice names become file names on extraction: no '/', ".", ".." or ""
+static inline int evo_safe_slice_name(const char *name) {
+    return *name != '\0' && strchr(name, '/') == NULL && strcmp(name, ".") != 0 && strcmp(name, "..") != 0;
+}
+
+// The slice table checksum covers the header and metadata as well as the
+// slice entries, so a device that reads only its own slices still notices
+// corrupt metadata.
+static inline uint32_t evo_slice_table_checksum(const struct evo_header *header, const evo_metadata *metadata,
+                                                const struct evo_slice *slices, uint32_t num_slices) {
+    struct evo_checksum ctx;
+    evo_checksum_init(&ctx);
+    evo_checksum_update(&ctx, header, sizeof(*header));
+    evo_checksum_update(&ctx, metadata, sizeof(*metadata));
+    evo_checksum_update(&ctx, slices, (size_t)num_slices * sizeof(struct evo_slice));
+    return evo_checksum_final(&ctx);
+}
+
+// Read and verify the slice table of a sliced package. On success *slices
+// holds table->num_slices entries that the caller must free().
+static inline int evo_load_slices(int fd, const struct evo_header *header,
+                                  struct evo_slice_table *table, struct evo_slice **slices) {
+    uint64_t table_end = evo_data_offset(header) + header->data_size;
+    *slices = NULL;
+    if (header->data_size < sizeof(*table) ||
+        pread(fd, table, sizeof(*table), table_end - sizeof(*table)) != sizeof(*table))
+        return -1;
+    if (table->num_slices > EVO_MAX_SLICES || header->metadata_size != sizeof(evo_metadata))
+        return -1;
+
+    size_t entries_size = (size_t)table->num_slices * sizeof(struct evo_slice);
+    if (entries_size + sizeof(*table) > header->data_size)
+        return -1;
+    *slices = malloc(entries_size > 0 ? entries_size : 1);
+    if (*slices == NULL)
+        return -1;
+    if (pread(fd, *slices, entries_size, table_end - sizeof(*table) - entries_size) != (ssize_t)entries_size) {
+        free(*slices);
+        *slices = NULL;
+        return -1;
+    }
+
+    evo_metadata *metadata = malloc(sizeof(*metadata));
+    int valid = metadata != NULL &&
+        pread(fd, metadata, sizeof(*metadata), sizeof(*header)) == sizeof(*metadata) &&
+        evo_slice_table_checksum(header, metadata, *slices, table->num_slices) == table->table_checksum;
+    free(metadata);
+    if (!valid) {
+        free(*slices);
+        *slices = NULL;
+        return -1;
+    }
+
+    uint64_t payload_end = header->data_size - sizeof(*table) - entries_size;
+    for (uint32_t i = 0; i < table->num_slices; i++) {
+        (*slices)[i].architecture[EVO_MAX_SLICE_NAME_LENGTH - 1] = '\0';
+        if ((*slices)[i].offset > payload_end || (*slices)[i].size > payload_end - (*slices)[i].offset ||
+            !evo_safe_slice_name((*slices)[i].architecture)) {
+            free(*slices);
+            *slices = NULL;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static inline const struct evo_slice *evo_find_slice(const struct evo_slice *slices, uint32_t num_slices,
+                                                     const char *architecture) {
+    for (uint32_t i = 0; i < num_slices; i++) {
+        if (strcmp(slices[i].architecture, architecture) == 0)
+            return &slices[i];
+    }
+    return NULL;
+}
+
+// Returns 1 if the slice payload matches its checksum, 0 if it does not and
+// -1 if it could not be read.
+static inline int evo_verify_slice(int fd, const struct evo_header *header, const struct evo_slice *slice) {
+    struct evo_checksum ctx;
+    evo_checksum_init(&ctx);
+    if (evo_checksum_file_range(&ctx, fd, evo_data_offset(header) + slice->offset, slice->size) == -1)
+        return -1;
+    return evo_checksum_final(&ctx) == slice->checksum;
+}
+
+#endif // EVO_SLICE_H
@@ -0,0 +1,124 @@
+#ifndef EVO_TREE_H
+#define EVO_TREE_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "evo_format.h"
+#include "evo_checksum.h"
+#include "evo_slice.h"
+
+struct evo_file_tree {
+    struct evo_file_table table;
+    struct evo_file_entry *entries;
+    char *paths;
+    uint64_t data_offset;  // Offset of the data section in the package
+};
+
+static inline const char *evo_file_path(const struct evo_file_tree *tree, uint32_t index) {
+    return tree->paths + tree->entries[index].path_offset;
+}
+
+// Relative paths only, without empty, "." or ".." components
+static inline int evo_safe_path(const char *path) {
+    if (*path == '\0' || *path == '/' || strchr(path, '\n') != NULL)
+        return 0;
+    for (const char *p = path; *p != '\0';) {
+        size_t length = strcspn(p, "/");
+        if (length == 0 || (length == 1 && p[0] == '.') || (length == 2 && p[0] == '.' && p[1] == '.'))
+            return 0;
+        p += length;
+        if (*p == '/')
+            p++;
+    }
+    return 1;
+}
+
+// Index of the entry whose path is the first length bytes of path, or -1.
+// Entries are sorted by path.
+static inline int evo_find_file(const struct evo_file_tree *tree, const char *path, size_t length) {
+    uint32_t low = 0, high = tree->table.num_files;
+    while (low < high) {
+        uint32_t middle = low + (high - low) / 2;
+        const char *candidate = evo_file_path(tree, middle);
+        int order = strncmp(candidate, path, length);
+        if (order == 0)
+            order = candidate[length] != '\0';
+        if (order == 0)
+            return (int)middle;
+        if (order < 0)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return -1;
+}
+
+static inline void evo_free_file_tree(struct evo_file_tree *tree) {
+    free(tree->entries);
+    free(tree->paths);
+    tree->entries = NULL;
+    tree->paths = NULL;
+}
+
+// Read and validate the file table of a file-tree package. Entries must be
+// sorted by path, which lets callers look paths up with evo_find_file(), and
+// the parent of every entry must itself be a directory entry, so that
+// installing the tree never writes through a symlink the package created.
+static inline int evo_load_file_tree(int fd, const struct evo_header *header, struct evo_file_tree *tree) {
+    memset(tree, 0, sizeof(*tree));
+    tree->data_offset = evo_data_offset(header);
+    uint64_t table_end = tree->data_offset + header->data_size;
+    if (header->data_size < sizeof(tree->table) ||
+        pread(fd, &tree->table, sizeof(tree->table), table_end - sizeof(tree->table)) != sizeof(tree->table))
+        return -1;
+
+    uint64_t entries_size = (uint64_t)tree->table.num_files * sizeof(struct evo_file_entry);
+    uint64_t paths_size = tree->table.path_table_size;
+    if (entries_size + paths_size + sizeof(tree->table) > header->data_size || paths_size == 0)
+        return -1;
+    uint64_t payload_end = header->data_size - sizeof(tree->table) - paths_size - entries_size;
+
+    tree->entries = malloc(entries_size > 0 ? entries_size : 1);
+    tree->paths = malloc(paths_size);
+    if (tree->entries == NULL || tree->paths == NULL ||
+        pread(fd, tree->entries, entries_size, tree->data_offset + payload_end) != (ssize_t)entries_size ||
+        pread(fd, tree->paths, paths_size, tree->data_offset + payload_end + entries_size) != (ssize_t)paths_size) {
+        evo_free_file_tree(tree);
+        return -1;
+    }
+
+    struct evo_checksum ctx;
+    evo_checksum_init(&ctx);
+    evo_checksum_update(&ctx, tree->entries, entries_size);
+    evo_checksum_update(&ctx, tree->paths, paths_size);
+    if (evo_checksum_final(&ctx) != tree->table.table_checksum || tree->paths[paths_size - 1] != '\0') {
+        evo_free_file_tree(tree);
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < tree->table.num_files; i++) {
+        const struct evo_file_entry *entry = &tree->entries[i];
+        if (entry->path_offset >= paths_size || !evo_safe_path(evo_file_path(tree, i)) ||
+            entry->offset > payload_end || entry->size > payload_end - entry->offset ||
+            !(S_ISREG(entry->mode) || S_ISDIR(entry->mode) || S_ISLNK(entry->mode)) ||
+            (i > 0 && strcmp(evo_file_path(tree, i - 1), evo_file_path(tree, i)) >= 0)) {
+            evo_free_file_tree(tree);
+            return -1;
+        }
+    }
+    for (uint32_t i = 0; i < tree->table.num_files; i++) {
+        const char *path = evo_file_path(tree, i);
+        const char *slash = strrchr(path, '/');
+        int parent = slash ? evo_find_file(tree, path, slash - path) : -1;
+        if (slash != NULL && (parent == -1 || !S_ISDIR(tree->entries[parent].mode))) {
+            evo_free_file_tree(tree);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+#endif // EVO_TREE_H
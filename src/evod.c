@@ -0,0 +1,795 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <errno.h>
+#include <signal.h>
+#include <setjmp.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "evo_format.h"
+#include "evo_metadata.h"
+#include "evo_checksum.h"
+#include "evo_slice.h"
+#include "evo_install.h"
+#include "evo_output.h"
+#include "evod_protocol.h"
+
+// evod keeps recently used packages memory-mapped, together with their
+// header, metadata and checksum result, so that repeated requests from a
+// package manager skip the open, decode and verification work that every
+// tool invocation otherwise repeats.
+
+#define DEFAULT_CACHE_SIZE 64
+
+// The socket is only reachable by the daemon's user and group. Requests
+// are further checked against the credentials of the connected peer:
+// packages must be readable by the peer, and outputs are only written into
+// directories the peer owns, as new files renamed into place, so a client
+// can never make the daemon write somewhere it could not write itself.
+#define SOCKET_MODE 0660
+
+struct client {
+    int fd;
+    struct ucred peer;
+};
+
+struct cache_entry {
+    char *path;
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    off_t size;
+    mode_t mode;
+    uid_t uid;
+    gid_t gid;
+
+    const uint8_t *map;
+    struct evo_header header;
+    const evo_metadata *metadata; // Points into map
+
+    pthread_mutex_t verify_lock;
+    int verified;                 // -1 until the checksum has been computed
+    uint32_t stored_checksum;
+    uint32_t calculated_checksum;
+
+    unsigned refs;                // The cache itself holds one reference
+    struct cache_entry *prev, *next;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    struct cache_entry *head, *tail; // Most recently used first
+    unsigned count, capacity;
+} cache = {PTHREAD_MUTEX_INITIALIZER, NULL, NULL, 0, DEFAULT_CACHE_SIZE};
+
+static const char *socket_path = EVOD_SOCKET_PATH;
+
+// A package can be truncated by another process while it is mapped, and
+// touching the lost pages raises SIGBUS. Reads from a mapping go through
+// map_copy() or run with fault_jump set, so a fault fails that request with
+// EIO instead of killing the daemon. Writes to sockets and files straight
+// from a mapping fail with EFAULT rather than faulting.
+static __thread sigjmp_buf *fault_jump;
+
+void print_usage(const char *program_name) {
+    fprintf(stderr, "Usage: %s [--socket <path>] [--cache-size <packages>]\n", program_name);
+}
+
+void handle_fault(int signal_number) {
+    if (fault_jump != NULL)
+        siglongjmp(*fault_jump, 1);
+    signal(signal_number, SIG_DFL);
+    raise(signal_number);
+}
+
+// memcpy() out of a mapping. Returns 0 or EIO.
+int map_copy(void *destination, const void *source, size_t length) {
+    sigjmp_buf jump;
+    if (sigsetjmp(jump, 0) != 0) {
+        fault_jump = NULL;
+        return EIO;
+    }
+    fault_jump = &jump;
+    memcpy(destination, source, length);
+    fault_jump = NULL;
+    return 0;
+}
+
+uint32_t crc32(const void *data, size_t length) {
+    uint32_t crc = 0xffffffff;
+    const uint8_t *p = (const uint8_t *)data;
+    while (length--) {
+        crc ^= *p++;
+        for (int i = 0; i < 8; i++)
+            crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+    }
+    return ~crc;
+}
+
+void free_entry(struct cache_entry *entry) {
+    munmap((void *)entry->map, entry->size);
+    pthread_mutex_destroy(&entry->verify_lock);
+    free(entry->path);
+    free(entry);
+}
+
+// Both of these expect cache.lock to be held
+void unlink_entry(struct cache_entry *entry) {
+    if (entry->prev)
+        entry->prev->next = entry->next;
+    else
+        cache.head = entry->next;
+    if (entry->next)
+        entry->next->prev = entry->prev;
+    else
+        cache.tail = entry->prev;
+    entry->prev = entry->next = NULL;
+    cache.count--;
+}
+
+void push_front(struct cache_entry *entry) {
+    entry->prev = NULL;
+    entry->next = cache.head;
+    if (cache.head)
+        cache.head->prev = entry;
+    cache.head = entry;
+    if (cache.tail == NULL)
+        cache.tail = entry;
+    cache.count++;
+}
+
+void release_entry(struct cache_entry *entry) {
+    pthread_mutex_lock(&cache.lock);
+    int last = --entry->refs == 0;
+    pthread_mutex_unlock(&cache.lock);
+    if (last)
+        free_entry(entry);
+}
+
+// Map a package and decode its header. Returns NULL with errno set.
+struct cache_entry *load_entry(const char *path) {
+    int fd = evo_open_package(path, O_RDONLY);
+    if (fd == -1)
+        return NULL;
+
+    struct stat package_stat;
+    if (fstat(fd, &package_stat) == -1) {
+        close(fd);
+        return NULL;
+    }
+    if ((size_t)package_stat.st_size < sizeof(struct evo_header) + sizeof(struct evo_footer)) {
+        close(fd);
+        errno = EINVAL;
+        return NULL;
+    }
+    void *map = mmap(NULL, package_stat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return NULL;
+
+    struct cache_entry *entry = calloc(1, sizeof(*entry));
+    if (entry == NULL || (entry->path = strdup(path)) == NULL) {
+        free(entry);
+        munmap(map, package_stat.st_size);
+        errno = ENOMEM;
+        return NULL;
+    }
+    entry->dev = package_stat.st_dev;
+    entry->ino = package_stat.st_ino;
+    entry->mtime = package_stat.st_mtim;
+    entry->size = package_stat.st_size;
+    entry->mode = package_stat.st_mode;
+    entry->uid = package_stat.st_uid;
+    entry->gid = package_stat.st_gid;
+    entry->map = map;
+    entry->verified = -1;
+    entry->refs = 1;
+    pthread_mutex_init(&entry->verify_lock, NULL);
+
+    // The header must describe exactly the file we mapped
+    if (map_copy(&entry->header, map, sizeof(entry->header)) != 0 ||
+        memcmp(entry->header.magic, EVO_MAGIC, sizeof(entry->header.magic)) != 0 ||
+        entry->header.metadata_size != sizeof(evo_metadata) ||
+        evo_data_offset(&entry->header) + entry->header.data_size + sizeof(struct evo_footer) !=
+            (uint64_t)entry->size) {
+        free_entry(entry);
+        errno = EINVAL;
+        return NULL;
+    }
+    entry->metadata = (const evo_metadata *)(entry->map + sizeof(struct evo_header));
+    madvise(map, entry->size, MADV_WILLNEED);
+    return entry;
+}
+
+// Look a package up in the cache, mapping it on a miss. A cached entry is
+// reused only while the file on disk is the same one that was mapped.
+struct cache_entry *acquire_entry(const char *path) {
+    struct stat package_stat;
+    if (stat(path, &package_stat) == -1)
+        return NULL;
+
+    pthread_mutex_lock(&cache.lock);
+    for (struct cache_entry *entry = cache.head; entry != NULL; entry = entry->next) {
+        if (strcmp(entry->path, path) != 0)
+            continue;
+        if (entry->dev == package_stat.st_dev && entry->ino == package_stat.st_ino &&
+            entry->size == package_stat.st_size &&
+            entry->mtime.tv_sec == package_stat.st_mtim.tv_sec &&
+            entry->mtime.tv_nsec == package_stat.st_mtim.tv_nsec) {
+            unlink_entry(entry);
+            push_front(entry);
+            entry->refs++;
+            pthread_mutex_unlock(&cache.lock);
+            return entry;
+        }
+        // Stale: the package was replaced since it was mapped
+        unlink_entry(entry);
+        if (--entry->refs == 0)
+            free_entry(entry);
+        break;
+    }
+    pthread_mutex_unlock(&cache.lock);
+
+    // Map outside the lock so that misses do not stall other clients
+    struct cache_entry *loaded = load_entry(path);
+    if (loaded == NULL)
+        return NULL;
+
+    pthread_mutex_lock(&cache.lock);
+    for (struct cache_entry *entry = cache.head; entry != NULL; entry = entry->next) {
+        // Another client mapped the same file meanwhile: share theirs
+        if (strcmp(entry->path, path) == 0 && entry->dev == loaded->dev && entry->ino == loaded->ino &&
+            entry->size == loaded->size && entry->mtime.tv_sec == loaded->mtime.tv_sec &&
+            entry->mtime.tv_nsec == loaded->mtime.tv_nsec) {
+            entry->refs++;
+            pthread_mutex_unlock(&cache.lock);
+            free_entry(loaded);
+            return entry;
+        }
+    }
+    push_front(loaded);
+    loaded->refs++;
+    while (cache.count > cache.capacity) {
+        struct cache_entry *victim = cache.tail;
+        unlink_entry(victim);
+        if (--victim->refs == 0)
+            free_entry(victim);
+    }
+    pthread_mutex_unlock(&cache.lock);
+    return loaded;
+}
+
+// Checksum a whole mapping. Returns 0 or EIO.
+int checksum_map(const struct cache_entry *entry, uint32_t *stored, uint32_t *calculated) {
+    static __thread struct evo_checksum ctx;
+    size_t content_size = entry->size - sizeof(struct evo_footer);
+    struct evo_footer footer;
+    sigjmp_buf jump;
+    if (sigsetjmp(jump, 0) != 0) {
+        fault_jump = NULL;
+        return EIO;
+    }
+    fault_jump = &jump;
+    evo_checksum_init(&ctx);
+    evo_checksum_update(&ctx, entry->map, content_size);
+    memcpy(&footer, entry->map + content_size, sizeof(footer));
+    fault_jump = NULL;
+    *stored = footer.checksum;
+    *calculated = evo_checksum_final(&ctx);
+    return 0;
+}
+
+// Compute the package checksum once per mapping and remember the result.
+// Returns 0, or EIO if the package was truncated under the mapping.
+int verify_entry(struct cache_entry *entry) {
+    int result = 0;
+    pthread_mutex_lock(&entry->verify_lock);
+    if (entry->verified == -1) {
+        result = checksum_map(entry, &entry->stored_checksum, &entry->calculated_checksum);
+        if (result == 0)
+            entry->verified = entry->stored_checksum == entry->calculated_checksum;
+    }
+    pthread_mutex_unlock(&entry->verify_lock);
+    return result;
+}
+
+int read_full(int fd, void *data, size_t length) {
+    uint8_t *p = data;
+    while (length > 0) {
+        ssize_t n = read(fd, p, length);
+        if (n <= 0) {
+            if (n == -1 && errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += n;
+        length -= n;
+    }
+    return 0;
+}
+
+int write_full(int fd, const void *data, size_t length) {
+    const uint8_t *p = data;
+    while (length > 0) {
+        ssize_t n = write(fd, p, length);
+        if (n <= 0) {
+            if (n == -1 && errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += n;
+        length -= n;
+    }
+    return 0;
+}
+
+int pwrite_full(int fd, const void *data, size_t length, off_t offset) {
+    const uint8_t *p = data;
+    while (length > 0) {
+        ssize_t n = pwrite(fd, p, length, offset);
+        if (n <= 0) {
+            if (n == -1 && errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += n;
+        offset += n;
+        length -= n;
+    }
+    return 0;
+}
+
+// Permission bits the peer gets on a package, judged by owner and primary
+// group; root may read anything
+int peer_may_read(const struct cache_entry *entry, const struct ucred *peer) {
+    if (peer->uid == 0)
+        return 1;
+    if (peer->uid == entry->uid)
+        return (entry->mode & S_IRUSR) != 0;
+    if (peer->gid == entry->gid)
+        return (entry->mode & S_IRGRP) != 0;
+    return (entry->mode & S_IROTH) != 0;
+}
+
+// Check that a directory belongs to the peer (root may use any directory)
+int check_peer_directory(int dir_fd, const struct ucred *peer) {
+    struct stat dir_stat;
+    if (fstat(dir_fd, &dir_stat) == -1)
+        return errno;
+    if (!S_ISDIR(dir_stat.st_mode))
+        return ENOTDIR;
+    return peer->uid == 0 || dir_stat.st_uid == peer->uid ? 0 : EACCES;
+}
+
+// Open the directory that will hold output, and point *name at its last
+// component. Returns the directory fd, or -1 with errno set.
+int open_output_parent(const char *output, const struct ucred *peer, const char **name) {
+    const char *slash = strrchr(output, '/');
+    char parent[EVOD_MAX_PATH + 1];
+    if (slash == NULL) {
+        strcpy(parent, ".");
+        *name = output;
+    } else {
+        size_t length = slash == output ? 1 : (size_t)(slash - output);
+        memcpy(parent, output, length);
+        parent[length] = '\0';
+        *name = slash + 1;
+    }
+    if (**name == '\0' || strcmp(*name, ".") == 0 || strcmp(*name, "..") == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    int dir_fd = open(parent, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd == -1)
+        return -1;
+    int error = check_peer_directory(dir_fd, peer);
+    if (error) {
+        close(dir_fd);
+        errno = error;
+        return -1;
+    }
+    return dir_fd;
+}
+
+// Open the output directory name in dir_fd for the peer, creating it if
+// needed. Returns the directory fd, or -1 with errno set.
+int open_output_directory(int dir_fd, const char *name, const struct ucred *peer) {
+    if (mkdirat(dir_fd, name, 0755) == 0) {
+        if (geteuid() == 0 && fchownat(dir_fd, name, peer->uid, peer->gid, AT_SYMLINK_NOFOLLOW) == -1)
+            return -1;
+    } else if (errno != EEXIST) {
+        return -1;
+    }
+    int fd = openat(dir_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd == -1)
+        return -1;
+    int error = check_peer_directory(fd, peer);
+    if (error) {
+        close(fd);
+        errno = error;
+        return -1;
+    }
+    return fd;
+}
+
+// Outputs are written to a new file next to name and renamed over it, so
+// an existing file, symlink or hard link at name is replaced rather than
+// written through. Returns the fd, or -1 with errno set.
+int create_output(int dir_fd, const char *name, const struct ucred *peer, char *temporary, size_t size) {
+    snprintf(temporary, size, ".%s.evod-new.%d.%ld", name, (int)getpid(), (long)pthread_self() & 0xffffff);
+    int fd = openat(dir_fd, temporary, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0644);
+    if (fd == -1)
+        return -1;
+    if (geteuid() == 0 && fchown(fd, peer->uid, peer->gid) == -1) {
+        int error = errno;
+        close(fd);
+        unlinkat(dir_fd, temporary, 0);
+        errno = error;
+        return -1;
+    }
+    return fd;
+}
+
+// Rename a finished output into place, or drop it if error is set. Returns
+// 0 or an errno value.
+int finish_output(int dir_fd, int fd, const char *temporary, const char *name, int error) {
+    if (close(fd) == -1 && error == 0)
+        error = errno;
+    if (error == 0 && renameat(dir_fd, temporary, dir_fd, name) == -1)
+        error = errno;
+    if (error)
+        unlinkat(dir_fd, temporary, 0);
+    return error;
+}
+
+int write_file(int dir_fd, const char *name, const struct ucred *peer, const void *data, size_t length) {
+    char temporary[EVOD_MAX_PATH + 64];
+    int fd = create_output(dir_fd, name, peer, temporary, sizeof(temporary));
+    if (fd == -1)
+        return errno;
+    return finish_output(dir_fd, fd, temporary, name, write_full(fd, data, length) == -1 ? errno : 0);
+}
+
+// Same output as evo-extract, written straight from the mapping into name
+// in dir_fd. Returns 0 or an errno value.
+int extract_into(const struct cache_entry *entry, int dir_fd, const char *name, const char *architecture,
+                 const struct ucred *peer) {
+    const uint8_t *data = entry->map + evo_data_offset(&entry->header);
+    uint64_t data_size = entry->header.data_size;
+
+    if (entry->header.version == EVO_VERSION_SLICED) {
+        struct evo_slice_table table;
+        if (data_size < sizeof(table))
+            return EINVAL;
+        if (map_copy(&table, data + data_size - sizeof(table), sizeof(table)) != 0)
+            return EIO;
+        size_t entries_size = (size_t)table.num_slices * sizeof(struct evo_slice);
+        if (table.num_slices > EVO_MAX_SLICES || entries_size + sizeof(table) > data_size)
+            return EINVAL;
+        const uint8_t *entries = data + data_size - sizeof(table) - entries_size;
+        if (architecture != NULL) {
+            int found = 0;
+            for (uint32_t i = 0; i < table.num_slices; i++) {
+                struct evo_slice slice;
+                if (map_copy(&slice, entries + i * sizeof(slice), sizeof(slice)) != 0)
+                    return EIO;
+                slice.architecture[EVO_MAX_SLICE_NAME_LENGTH - 1] = '\0';
+                found |= strcmp(slice.architecture, architecture) == 0;
+            }
+            if (!found)
+                return ENOENT;
+        }
+        int output_fd = open_output_directory(dir_fd, name, peer);
+        if (output_fd == -1)
+            return errno;
+        int error = 0;
+        for (uint32_t i = 0; i < table.num_slices && error == 0; i++) {
+            struct evo_slice slice;
+            if (map_copy(&slice, entries + i * sizeof(slice), sizeof(slice)) != 0) {
+                error = EIO;
+                break;
+            }
+            slice.architecture[EVO_MAX_SLICE_NAME_LENGTH - 1] = '\0';
+            if (architecture != NULL && strcmp(slice.architecture, architecture) != 0 &&
+                strcmp(slice.architecture, EVO_SLICE_SHARED) != 0)
+                continue;
+            if (slice.offset > data_size || slice.size > data_size - slice.offset ||
+                !evo_safe_slice_name(slice.architecture))
+                error = EINVAL;
+            else
+                error = write_file(output_fd, slice.architecture, peer, data + slice.offset, slice.size);
+        }
+        close(output_fd);
+        return error;
+    }
+
+    if (entry->header.version == EVO_VERSION_TREE) {
+        // Installing needs a file descriptor; make sure it is the file we mapped
+        struct stat package_stat;
+        struct evo_install_stats stats;
+        int fd = open(entry->path, O_RDONLY | O_CLOEXEC);
+        if (fd == -1)
+            return errno;
+        if (fstat(fd, &package_stat) == -1 || package_stat.st_ino != entry->ino || package_stat.st_dev != entry->dev) {
+            close(fd);
+            return ESTALE;
+        }
+        int root_fd = open_output_directory(dir_fd, name, peer);
+        if (root_fd == -1) {
+            int error = errno;
+            close(fd);
+            return error;
+        }
+        int result = evo_install_tree_at(fd, &entry->header, root_fd, NULL, 1, &stats);
+        close(root_fd);
+        close(fd);
+        return result == -1 ? EIO : 0;
+    }
+
+    if (entry->header.version != EVO_VERSION_SPARSE)
+        return write_file(dir_fd, name, peer, data, data_size);
+
+    struct evo_extent_table table;
+    if (data_size < sizeof(table))
+        return EINVAL;
+    if (map_copy(&table, data + data_size - sizeof(table), sizeof(table)) != 0)
+        return EIO;
+    size_t map_size = (size_t)table.num_extents * sizeof(struct evo_extent);
+    if (table.reserved != 0 || map_size + sizeof(table) > data_size)
+        return EINVAL;
+    const uint8_t *extents = data + data_size - sizeof(table) - map_size;
+    uint64_t payload_limit = data_size - sizeof(table) - map_size;
+
+    char temporary[EVOD_MAX_PATH + 64];
+    int fd = create_output(dir_fd, name, peer, temporary, sizeof(temporary));
+    if (fd == -1)
+        return errno;
+    uint64_t position = 0;
+    int error = 0;
+    for (uint32_t i = 0; i < table.num_extents && error == 0; i++) {
+        struct evo_extent extent;
+        error = map_copy(&extent, extents + i * sizeof(extent), sizeof(extent));
+        if (error == 0 && (extent.length > payload_limit - position || extent.offset > table.image_size ||
+                           extent.length > table.image_size - extent.offset))
+            error = EINVAL;
+        else if (error == 0 && pwrite_full(fd, data + position, extent.length, extent.offset) == -1)
+            error = errno;
+        position += extent.length;
+    }
+    if (error == 0 && ftruncate(fd, table.image_size) == -1)
+        error = errno;
+    return finish_output(dir_fd, fd, temporary, name, error);
+}
+
+int extract_entry(const struct cache_entry *entry, const char *output, const char *architecture,
+                  const struct ucred *peer) {
+    const char *name;
+    int dir_fd = open_output_parent(output, peer, &name);
+    if (dir_fd == -1)
+        return errno;
+    int error = extract_into(entry, dir_fd, name, architecture, peer);
+    close(dir_fd);
+    return error;
+}
+
+int send_response(int client_fd, struct evod_response *response, const void *payload) {
+    if (write_full(client_fd, response, sizeof(*response)) == -1)
+        return -1;
+    if (response->length > 0 && write_full(client_fd, payload, response->length) == -1)
+        return -1;
+    return 0;
+}
+
+int send_error(int client_fd, int status) {
+    struct evod_response response;
+    memset(&response, 0, sizeof(response));
+    response.status = status;
+    return send_response(client_fd, &response, NULL);
+}
+
+// Serve one request. Returns -1 when the connection should be dropped.
+int handle_request(int client_fd, const struct ucred *peer) {
+    struct evod_request request;
+    char path[EVOD_MAX_PATH + 1];
+    char output[EVOD_MAX_PATH + 1];
+    char architecture[EVO_MAX_SLICE_NAME_LENGTH];
+
+    if (read_full(client_fd, &request, sizeof(request)) == -1)
+        return -1;
+    if (request.path_length == 0 || request.path_length > EVOD_MAX_PATH ||
+        request.output_length > EVOD_MAX_PATH || request.arch_length >= EVO_MAX_SLICE_NAME_LENGTH)
+        return -1;
+    if (read_full(client_fd, path, request.path_length) == -1 ||
+        read_full(client_fd, output, request.output_length) == -1 ||
+        read_full(client_fd, architecture, request.arch_length) == -1)
+        return -1;
+    path[request.path_length] = '\0';
+    output[request.output_length] = '\0';
+    architecture[request.arch_length] = '\0';
+
+    struct cache_entry *entry = acquire_entry(path);
+    if (entry == NULL)
+        return send_error(client_fd, errno ? errno : EIO);
+    if (!peer_may_read(entry, peer)) {
+        release_entry(entry);
+        return send_error(client_fd, EACCES);
+    }
+
+    struct evod_response response;
+    memset(&response, 0, sizeof(response));
+    const void *payload = NULL;
+
+    switch (request.op) {
+        case EVOD_OP_METADATA:
+            // Header and metadata are contiguous at the start of the mapping
+            payload = entry->map;
+            response.length = sizeof(struct evo_header) + entry->header.metadata_size;
+            break;
+        case EVOD_OP_VERIFY:
+        case EVOD_OP_READ:
+        case EVOD_OP_EXTRACT:
+            // Data is only handed out from packages that passed verification
+            if (verify_entry(entry) != 0) {
+                response.status = EIO;
+                break;
+            }
+            response.verified = entry->verified;
+            response.stored_checksum = entry->stored_checksum;
+            response.calculated_checksum = entry->calculated_checksum;
+            if (request.op == EVOD_OP_VERIFY)
+                break;
+            if (!entry->verified) {
+                response.status = EBADMSG;
+            } else if (request.op == EVOD_OP_READ) {
+                if (request.offset > entry->header.data_size ||
+                    request.length > entry->header.data_size - request.offset) {
+                    response.status = ERANGE;
+                } else {
+                    payload = entry->map + evo_data_offset(&entry->header) + request.offset;
+                    response.length = request.length;
+                }
+            } else if (request.output_length == 0) {
+                response.status = EINVAL;
+            } else {
+                response.status = extract_entry(entry, output, request.arch_length ? architecture : NULL, peer);
+            }
+            break;
+        default:
+            response.status = EINVAL;
+            break;
+    }
+
+    int result = send_response(client_fd, &response, payload);
+    release_entry(entry);
+    return result;
+}
+
+void *serve_client(void *arg) {
+    struct client *client = arg;
+    while (handle_request(client->fd, &client->peer) == 0)
+        ;
+    close(client->fd);
+    free(client);
+    return NULL;
+}
+
+void handle_signal(int signal_number) {
+    (void)signal_number;
+    unlink(socket_path);
+    _exit(0);
+}
+
+int main(int argc, char *argv[]) {
+    static const struct option long_options[] = {
+        {"socket", required_argument, NULL, 's'},
+        {"cache-size", required_argument, NULL, 'c'},
+        {NULL, 0, NULL, 0}
+    };
+
+    // Parse command-line arguments
+    int opt;
+    while ((opt = getopt_long(argc, argv, "s:c:", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 's':
+                socket_path = optarg;
+                break;
+            case 'c': {
+                char *end;
+                long capacity = strtol(optarg, &end, 10);
+                if (end == optarg || *end != '\0' || capacity <= 0 || capacity > UINT32_MAX) {
+                    fprintf(stderr, "Invalid cache size: %s\n", optarg);
+                    return 1;
+                }
+                cache.capacity = capacity;
+                break;
+            }
+            default:
+                print_usage(argv[0]);
+                return 1;
+        }
+    }
+    if (optind != argc) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", socket_path);
+        return 1;
+    }
+    strcpy(address.sun_path, socket_path);
+
+    int server_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (server_fd == -1) {
+        perror("Error creating socket");
+        return 1;
+    }
+    unlink(socket_path);
+    // The socket takes its mode from the umask when it is bound
+    mode_t old_umask = umask(0777 & ~SOCKET_MODE);
+    int bound = bind(server_fd, (struct sockaddr *)&address, sizeof(address));
+    umask(old_umask);
+    if (bound == -1 || chmod(socket_path, SOCKET_MODE) == -1 || listen(server_fd, SOMAXCONN) == -1) {
+        perror("Error binding socket");
+        close(server_fd);
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    struct sigaction fault_action;
+    memset(&fault_action, 0, sizeof(fault_action));
+    fault_action.sa_handler = handle_fault;
+    fault_action.sa_flags = SA_NODEFER; // siglongjmp() leaves the signal mask alone
+    sigaction(SIGBUS, &fault_action, NULL);
+    signal(SIGINT, handle_signal);
+    signal(SIGTERM, handle_signal);
+    printf("evod listening on %s (cache size %u)\n", socket_path, cache.capacity);
+    fflush(stdout);
+
+    // One thread per connection; clients are expected to keep their
+    // connection open across many requests
+    for (;;) {
+        int client_fd = accept4(server_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (client_fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED || errno == EMFILE || errno == ENFILE)
+                continue;
+            perror("Error accepting connection");
+            break;
+        }
+        struct client *client = malloc(sizeof(*client));
+        socklen_t peer_length = sizeof(client->peer);
+        if (client == NULL ||
+            getsockopt(client_fd, SOL_SOCKET, SO_PEERCRED, &client->peer, &peer_length) == -1) {
+            perror("Error reading peer credentials");
+            free(client);
+            close(client_fd);
+            continue;
+        }
+        client->fd = client_fd;
+        pthread_t thread;
+        pthread_attr_t attributes;
+        pthread_attr_init(&attributes);
+        pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+        if (pthread_create(&thread, &attributes, serve_client, client) != 0) {
+            fprintf(stderr, "Error creating client thread\n");
+            close(client_fd);
+            free(client);
+        }
+        pthread_attr_destroy(&attributes);
+    }
+
+    close(server_fd);
+    unlink(socket_path);
+    return 1;
+}
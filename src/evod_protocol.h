@@ -0,0 +1,39 @@
+#ifndef EVOD_PROTOCOL_H
+#define EVOD_PROTOCOL_H
+
+#include <stdint.h>
+
+// Wire protocol spoken by evod over a local Unix stream socket. A client
+// may send any number of requests on one connection; each request is
+// answered by exactly one response, in order. All integers are in host
+// byte order, since both ends always run on the same machine.
+
+#define EVOD_SOCKET_PATH "/run/evod.sock"
+#define EVOD_MAX_PATH 4096
+
+enum evod_op {
+    EVOD_OP_METADATA = 1, // Payload: struct evo_header followed by the metadata
+    EVOD_OP_VERIFY = 2,   // No payload; see verified and the checksums
+    EVOD_OP_READ = 3,     // Payload: the requested range of the data section
+    EVOD_OP_EXTRACT = 4   // No payload; the daemon writes the output itself, into a
+                          // directory owned by the client
+};
+
+struct evod_request {
+    uint32_t op;             // One of enum evod_op
+    uint32_t path_length;    // Package path bytes following the request
+    uint32_t output_length;  // EXTRACT: output path bytes following the package path
+    uint32_t arch_length;    // EXTRACT: optional architecture following the output path
+    uint64_t offset;         // READ: offset into the data section
+    uint64_t length;         // READ: number of bytes to return
+};
+
+struct evod_response {
+    int32_t status;               // 0 on success, otherwise an errno value
+    uint32_t verified;            // 1 if the package checksum matched
+    uint32_t stored_checksum;     // Checksum from the footer
+    uint32_t calculated_checksum; // Checksum of the package contents
+    uint64_t length;              // Payload bytes following the response
+};
+
+#endif // EVOD_PROTOCOL_H